@@ -0,0 +1,449 @@
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include "sfs_api.h"
+#include "disk_emu.h"
+#include "block_cache.h"
+
+#define NO_CACHE_ENTRY UINT32_MAX
+#define FLUSH_RUN_BLOCKS 64 // Longest run of dirty blocks written back with a single write
+
+typedef struct cache_entry_t {
+    uint32_t block;   // The disk block held by this entry
+    uint32_t next;    // The next entry in the same hash bucket
+    bool valid;
+    bool dirty;       // The entry holds changes that have not been written to the disk yet
+    bool referenced;  // Set on every access, cleared when the clock hand passes over the entry
+} cache_entry_t;
+
+cache_entry_t *cache_entries;
+uint8_t *cache_data;
+uint32_t *cache_buckets;
+uint32_t cache_capacity;
+uint32_t cache_num_of_buckets; // Always a power of two
+uint32_t cache_clock_hand;
+uint32_t cache_num_of_dirty; // Number of valid entries that are dirty
+uint64_t cache_hits;
+uint64_t cache_misses;
+// Guards every cache structure above. Runs read or written straight to the disk are transferred without holding it,
+// callers already keep other threads away from the blocks they transfer
+pthread_mutex_t cache_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/**
+ * Get the hash bucket of a disk block.
+ * @param block The disk block.
+ * @return The index of the bucket.
+ */
+uint32_t cache_bucket(uint32_t block) {
+    return (block * 2654435761u) & (cache_num_of_buckets - 1);
+}
+
+/**
+ * Get the data held by a cache entry.
+ * @param idx The index of the entry.
+ * @return A pointer to the block sized data of the entry.
+ */
+uint8_t *cache_entry_data(uint32_t idx) {
+    return cache_data + ((size_t) idx * BLOCK_SIZE);
+}
+
+/**
+ * Mark a cache entry as holding changes that are not on the disk yet, or as matching the disk, keeping count of them.
+ * @param idx The index of the entry.
+ * @param dirty True if the entry holds changes, false otherwise.
+ */
+void cache_set_dirty(uint32_t idx, bool dirty) {
+    if (cache_entries[idx].dirty != dirty) {
+        cache_entries[idx].dirty = dirty;
+        cache_num_of_dirty += dirty ? 1 : -1;
+    }
+}
+
+/**
+ * Find the cache entry holding a disk block.
+ * @param block The disk block to look for.
+ * @return The index of the entry if the block is cached, NO_CACHE_ENTRY otherwise.
+ */
+uint32_t cache_lookup(uint32_t block) {
+    uint32_t idx = cache_buckets[cache_bucket(block)];
+    while (idx != NO_CACHE_ENTRY && cache_entries[idx].block != block) {
+        idx = cache_entries[idx].next;
+    }
+    return idx;
+}
+
+/**
+ * Remove a cache entry from its hash bucket and mark it as unused.
+ * @param idx The index of the entry.
+ */
+void cache_unlink(uint32_t idx) {
+    uint32_t *link = &cache_buckets[cache_bucket(cache_entries[idx].block)];
+    while (*link != idx) {
+        link = &cache_entries[*link].next;
+    }
+    *link = cache_entries[idx].next;
+    cache_set_dirty(idx, false);
+    cache_entries[idx].valid = false;
+}
+
+/**
+ * Pick an entry to hold a new block using the CLOCK algorithm.
+ * Entries accessed since the hand last passed get a second chance, a dirty victim is written back first.
+ * @return The index of the now unused entry.
+ */
+uint32_t cache_evict() {
+    while (true) {
+        const uint32_t idx = cache_clock_hand;
+        cache_clock_hand = (cache_clock_hand + 1) % cache_capacity;
+        cache_entry_t *const entry = &cache_entries[idx];
+        if (!entry->valid) {
+            return idx;
+        }
+        if (entry->referenced) {
+            entry->referenced = false;
+            continue;
+        }
+        if (entry->dirty) {
+            write_blocks((int) entry->block, 1, cache_entry_data(idx));
+        }
+        cache_unlink(idx);
+        return idx;
+    }
+}
+
+/**
+ * Make room for a disk block in the cache. The data of the new entry is left for the caller to fill in.
+ * @param block The disk block to cache.
+ * @return The index of the entry for the block.
+ */
+uint32_t cache_insert(uint32_t block) {
+    const uint32_t idx = cache_evict();
+    const uint32_t bucket = cache_bucket(block);
+    cache_entries[idx].block = block;
+    cache_entries[idx].next = cache_buckets[bucket];
+    cache_entries[idx].valid = true;
+    cache_set_dirty(idx, false);
+    cache_entries[idx].referenced = true;
+    cache_buckets[bucket] = idx;
+    return idx;
+}
+
+/**
+ * Write every dirty block in the cache back to the disk, with the cache lock held.
+ * @return 0 if successful, -1 otherwise.
+ */
+int cache_flush_locked();
+
+/**
+ * Drop every block held by the cache, with the cache lock held.
+ */
+void cache_invalidate_locked();
+
+/**
+ * Set up the block cache with the cache lock held, writing back and dropping whatever the cache held before.
+ * @param capacity The number of blocks the cache can hold.
+ * @return 0 if successful, -1 otherwise.
+ */
+int cache_init_locked(uint32_t capacity) {
+    if (cache_entries != NULL) {
+        cache_flush_locked();
+        free(cache_entries);
+        free(cache_data);
+        free(cache_buckets);
+    }
+    cache_capacity = capacity > 0 ? capacity : DEFAULT_BLOCK_CACHE_CAPACITY;
+    // Twice as many buckets as entries keeps the chains short
+    cache_num_of_buckets = 1;
+    while (cache_num_of_buckets < cache_capacity * 2) {
+        cache_num_of_buckets <<= 1;
+    }
+    cache_entries = calloc(cache_capacity, sizeof(cache_entry_t));
+    cache_data = malloc((size_t) cache_capacity * BLOCK_SIZE);
+    cache_buckets = malloc(cache_num_of_buckets * sizeof(uint32_t));
+    if (cache_entries == NULL || cache_data == NULL || cache_buckets == NULL) {
+        free(cache_entries);
+        free(cache_data);
+        free(cache_buckets);
+        cache_entries = NULL;
+        cache_data = NULL;
+        cache_buckets = NULL;
+        return -1;
+    }
+    cache_hits = 0;
+    cache_misses = 0;
+    cache_invalidate_locked();
+    return 0;
+}
+
+/**
+ * Set up the block cache, writing back and dropping whatever the cache held before.
+ * The cache sets itself up with DEFAULT_BLOCK_CACHE_CAPACITY on first use, this can be called at any time to resize it.
+ * @param capacity The number of blocks the cache can hold.
+ * @return 0 if successful, -1 otherwise.
+ */
+int block_cache_init(uint32_t capacity) {
+    pthread_mutex_lock(&cache_lock);
+    const int result = cache_init_locked(capacity);
+    pthread_mutex_unlock(&cache_lock);
+    return result;
+}
+
+/**
+ * Read a series of blocks through the cache.
+ * Single blocks are cached on a miss. Longer reads are served from the cache where possible,
+ * and the remaining runs are read straight into the buffer without displacing cached blocks.
+ * @param start_address The first block to read.
+ * @param nblocks The number of blocks to read.
+ * @param buffer The buffer to read into.
+ * @return The number of blocks read if successful, -1 otherwise.
+ */
+int cache_read_blocks(uint32_t start_address, uint32_t nblocks, void *buffer) {
+    pthread_mutex_lock(&cache_lock);
+    if (cache_entries == NULL && cache_init_locked(DEFAULT_BLOCK_CACHE_CAPACITY) < 0) {
+        pthread_mutex_unlock(&cache_lock);
+        return read_blocks((int) start_address, (int) nblocks, buffer);
+    }
+
+    if (nblocks == 1) {
+        uint32_t idx = cache_lookup(start_address);
+        if (idx != NO_CACHE_ENTRY) {
+            cache_hits++;
+        } else {
+            cache_misses++;
+            idx = cache_insert(start_address);
+            if (read_blocks((int) start_address, 1, cache_entry_data(idx)) < 0) {
+                cache_unlink(idx);
+                pthread_mutex_unlock(&cache_lock);
+                return -1;
+            }
+        }
+        cache_entries[idx].referenced = true;
+        memcpy(buffer, cache_entry_data(idx), BLOCK_SIZE);
+        pthread_mutex_unlock(&cache_lock);
+        return 1;
+    }
+
+    uint32_t i = 0;
+    while (i < nblocks) {
+        const uint32_t idx = cache_lookup(start_address + i);
+        if (idx != NO_CACHE_ENTRY) {
+            cache_hits++;
+            cache_entries[idx].referenced = true;
+            memcpy((uint8_t *) buffer + ((size_t) i * BLOCK_SIZE), cache_entry_data(idx), BLOCK_SIZE);
+            i++;
+            continue;
+        }
+        // Read the whole run of blocks that are not cached at once
+        uint32_t run = 1;
+        while (i + run < nblocks && cache_lookup(start_address + i + run) == NO_CACHE_ENTRY) {
+            run++;
+        }
+        cache_misses += run;
+        pthread_mutex_unlock(&cache_lock);
+        const int result = read_blocks((int) (start_address + i), (int) run, (uint8_t *) buffer + ((size_t) i * BLOCK_SIZE));
+        pthread_mutex_lock(&cache_lock);
+        if (result < 0) {
+            pthread_mutex_unlock(&cache_lock);
+            return -1;
+        }
+        i += run;
+    }
+    pthread_mutex_unlock(&cache_lock);
+    return (int) nblocks;
+}
+
+/**
+ * Write a series of blocks through the cache.
+ * Single blocks are kept in the cache and written back later. Longer writes go straight to the disk,
+ * updating any copies that are cached.
+ * @param start_address The first block to write.
+ * @param nblocks The number of blocks to write.
+ * @param buffer The buffer to write from.
+ * @return The number of blocks written if successful, -1 otherwise.
+ */
+int cache_write_blocks(uint32_t start_address, uint32_t nblocks, const void *buffer) {
+    pthread_mutex_lock(&cache_lock);
+    if (cache_entries == NULL && cache_init_locked(DEFAULT_BLOCK_CACHE_CAPACITY) < 0) {
+        pthread_mutex_unlock(&cache_lock);
+        return write_blocks((int) start_address, (int) nblocks, (void *) buffer);
+    }
+
+    if (nblocks == 1) {
+        uint32_t idx = cache_lookup(start_address);
+        if (idx != NO_CACHE_ENTRY) {
+            cache_hits++;
+        } else {
+            // The whole block is overwritten, so there is no need to read it first
+            cache_misses++;
+            idx = cache_insert(start_address);
+        }
+        memcpy(cache_entry_data(idx), buffer, BLOCK_SIZE);
+        cache_set_dirty(idx, true);
+        cache_entries[idx].referenced = true;
+        pthread_mutex_unlock(&cache_lock);
+        return 1;
+    }
+
+    for (uint32_t i = 0; i < nblocks; ++i) {
+        const uint32_t idx = cache_lookup(start_address + i);
+        if (idx != NO_CACHE_ENTRY) {
+            memcpy(cache_entry_data(idx), (const uint8_t *) buffer + ((size_t) i * BLOCK_SIZE), BLOCK_SIZE);
+            cache_set_dirty(idx, false);
+        }
+    }
+    pthread_mutex_unlock(&cache_lock);
+    return write_blocks((int) start_address, (int) nblocks, (void *) buffer);
+}
+
+/**
+ * Order cache entry indices by the disk block they hold, for use with qsort.
+ */
+int compare_entry_blocks(const void *a, const void *b) {
+    const uint32_t block_a = cache_entries[*(const uint32_t *) a].block;
+    const uint32_t block_b = cache_entries[*(const uint32_t *) b].block;
+    return (block_a > block_b) - (block_a < block_b);
+}
+
+/**
+ * Write every dirty block in the cache back to the disk.
+ * The dirty blocks are sorted so that runs of adjacent blocks go out in a single write,
+ * and the runs are submitted to the disk queue together so their latencies overlap.
+ * @return 0 if successful, -1 otherwise.
+ */
+int block_cache_flush() {
+    pthread_mutex_lock(&cache_lock);
+    const int result = cache_flush_locked();
+    pthread_mutex_unlock(&cache_lock);
+    return result;
+}
+
+int cache_flush_locked() {
+    if (cache_entries == NULL || cache_num_of_dirty == 0) {
+        return 0;
+    }
+
+    uint32_t *const dirty = malloc(cache_capacity * sizeof(uint32_t));
+    uint32_t num_of_dirty = 0;
+    if (dirty == NULL) {
+        return -1;
+    }
+    for (uint32_t i = 0; i < cache_capacity; ++i) {
+        if (cache_entries[i].valid && cache_entries[i].dirty) {
+            dirty[num_of_dirty++] = i;
+        }
+    }
+    if (num_of_dirty == 0) {
+        free(dirty);
+        return 0;
+    }
+    qsort(dirty, num_of_dirty, sizeof(uint32_t), compare_entry_blocks);
+
+    // Every run gets its own request and buffer, so the runs are written in parallel
+    uint8_t *const run_bufs = malloc((size_t) num_of_dirty * BLOCK_SIZE);
+    disk_request *const requests = malloc(num_of_dirty * sizeof(disk_request));
+    if (run_bufs == NULL || requests == NULL) {
+        free(dirty);
+        free(run_bufs);
+        free(requests);
+        return -1;
+    }
+
+    int result = 0;
+    uint32_t num_of_requests = 0;
+    uint32_t i = 0;
+    while (i < num_of_dirty) {
+        const uint32_t first_block = cache_entries[dirty[i]].block;
+        uint8_t *const run_buf = run_bufs + ((size_t) i * BLOCK_SIZE);
+        uint32_t run = 0;
+        while (i + run < num_of_dirty && run < FLUSH_RUN_BLOCKS
+               && cache_entries[dirty[i + run]].block == first_block + run) {
+            memcpy(run_buf + ((size_t) run * BLOCK_SIZE), cache_entry_data(dirty[i + run]), BLOCK_SIZE);
+            cache_set_dirty(dirty[i + run], false);
+            run++;
+        }
+        disk_request *const request = &requests[num_of_requests];
+        request->is_write = 1;
+        request->start_address = (int) first_block;
+        request->nblocks = (int) run;
+        request->buffer = run_buf;
+        request->user_data = requests;
+        if (submit_blocks(request) == 0) {
+            num_of_requests++;
+        } else if (write_blocks((int) first_block, (int) run, run_buf) < 0) {
+            result = -1;
+        }
+        i += run;
+    }
+
+    // The requests of this flush are tagged with their array, so completions of other submitters are left alone
+    disk_request *completed[FLUSH_RUN_BLOCKS];
+    uint32_t num_of_completed = 0;
+    while (num_of_completed < num_of_requests) {
+        const uint32_t remaining = num_of_requests - num_of_completed;
+        const int max = remaining < FLUSH_RUN_BLOCKS ? (int) remaining : FLUSH_RUN_BLOCKS;
+        const int n = reap_blocks_matching(completed, max, 1, requests);
+        if (n == 0) {
+            break;
+        }
+        for (int j = 0; j < n; ++j) {
+            if (completed[j]->result < 0) {
+                result = -1;
+            }
+        }
+        num_of_completed += n;
+    }
+
+    free(dirty);
+    free(run_bufs);
+    free(requests);
+    return result;
+}
+
+/**
+ * Drop every block held by the cache without writing anything back.
+ */
+void block_cache_invalidate() {
+    pthread_mutex_lock(&cache_lock);
+    cache_invalidate_locked();
+    pthread_mutex_unlock(&cache_lock);
+}
+
+void cache_invalidate_locked() {
+    if (cache_entries == NULL) {
+        return;
+    }
+    for (uint32_t i = 0; i < cache_num_of_buckets; ++i) {
+        cache_buckets[i] = NO_CACHE_ENTRY;
+    }
+    for (uint32_t i = 0; i < cache_capacity; ++i) {
+        cache_entries[i].valid = false;
+        cache_entries[i].dirty = false;
+        cache_entries[i].referenced = false;
+    }
+    cache_num_of_dirty = 0;
+    cache_clock_hand = 0;
+}
+
+/**
+ * Get the hit and miss counters of the cache, counted per block since the cache was set up.
+ * @param hits A pointer to be populated with the number of hits.
+ * @param misses A pointer to be populated with the number of misses.
+ */
+void block_cache_stats(uint64_t *hits, uint64_t *misses) {
+    pthread_mutex_lock(&cache_lock);
+    *hits = cache_hits;
+    *misses = cache_misses;
+    pthread_mutex_unlock(&cache_lock);
+}
+
+/**
+ * Check whether the cache holds changes that have not been written to the disk yet.
+ * @return True if a cached block is dirty, false otherwise.
+ */
+bool block_cache_is_dirty() {
+    pthread_mutex_lock(&cache_lock);
+    const bool is_dirty = cache_num_of_dirty > 0;
+    pthread_mutex_unlock(&cache_lock);
+    return is_dirty;
+}
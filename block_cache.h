@@ -0,0 +1,23 @@
+#ifndef BLOCK_CACHE_H
+#define BLOCK_CACHE_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#define DEFAULT_BLOCK_CACHE_CAPACITY 1024 // Number of blocks held in memory, 1 MiB with 1 KiB blocks
+
+int block_cache_init(uint32_t capacity);
+
+int cache_read_blocks(uint32_t start_address, uint32_t nblocks, void *buffer);
+
+int cache_write_blocks(uint32_t start_address, uint32_t nblocks, const void *buffer);
+
+int block_cache_flush();
+
+void block_cache_invalidate();
+
+void block_cache_stats(uint64_t *hits, uint64_t *misses);
+
+bool block_cache_is_dirty();
+
+#endif
@@ -2,30 +2,157 @@
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
 #include <time.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include "disk_emu.h"
 
+#define DEFAULT_DISK_WORKERS 4
+#define DEFAULT_DISK_QUEUE_DEPTH 32
 
-FILE *fp = NULL;
+int fd = -1;
+char *disk_map = NULL; /*The whole disk when it is memory mapped, NULL otherwise*/
+size_t disk_map_length;
+int disk_unsynced = 0; /*Set after every write, cleared by the sync that makes it durable*/
 double L, p;
 double r;
 int BLOCK_SIZE, MAX_BLOCK, MAX_RETRY;
 
+/*The asynchronous queue, requests wait in the submission list, are run by the workers,
+  then wait in the completion list until they are reaped*/
+pthread_t *disk_workers = NULL;
+int num_disk_workers;
+int disk_queue_depth;
+int disk_queue_stopping;
+int disk_requests_in_flight; /*Submitted but not completed yet*/
+disk_request *submitted_head = NULL, *submitted_tail = NULL;
+disk_request *completed_head = NULL, *completed_tail = NULL;
+pthread_mutex_t disk_queue_lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t disk_queue_submitted = PTHREAD_COND_INITIALIZER;
+pthread_cond_t disk_queue_completed = PTHREAD_COND_INITIALIZER;
+pthread_once_t disk_queue_fork_once = PTHREAD_ONCE_INIT;
+
 /*----------------------------------------------------------*/
 /*Close the disk file filled when you don't need it anymore. */
 /*----------------------------------------------------------*/
 int close_disk() {
-    if (NULL != fp) {
-        fclose(fp);
+    /*Requests still queued belong to this disk, and no worker outlives it*/
+    stop_disk_queue();
+    if (NULL != disk_map) {
+        msync(disk_map, disk_map_length, MS_SYNC);
+        munmap(disk_map, disk_map_length);
+        disk_map = NULL;
+    }
+    if (-1 != fd) {
+        close(fd);
+        fd = -1;
     }
     return 0;
 }
 
+/*-------------------------------------------------------------------*/
+/*Moves a series of blocks between the disk and the buffer with a     */
+/*single positional call, repeated only if the transfer comes up short*/
+/*-------------------------------------------------------------------*/
+int transfer_blocks(int start_address, int nblocks, void *buffer, int is_write) {
+    const size_t length = (size_t) nblocks * BLOCK_SIZE;
+    const off_t offset = (off_t) start_address * BLOCK_SIZE;
+    size_t done = 0;
+
+    while (done < length) {
+        ssize_t n;
+        if (is_write) {
+            n = pwrite(fd, (char *) buffer + done, length - done, offset + (off_t) done);
+        } else {
+            n = pread(fd, (char *) buffer + done, length - done, offset + (off_t) done);
+        }
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n < 0 || (n == 0 && is_write)) {
+            return -1;
+        }
+        if (n == 0) {
+            /*Reading past the end of the file, which holds 0's*/
+            memset((char *) buffer + done, 0, length - done);
+            break;
+        }
+        done += (size_t) n;
+    }
+    return nblocks;
+}
+
+/*--------------------------------------------------------------*/
+/*Maps the whole disk file into memory, failing if it is short, */
+/*a fresh disk is sized before it is mapped                      */
+/*--------------------------------------------------------------*/
+int map_disk() {
+    struct stat st;
+
+    disk_map_length = (size_t) MAX_BLOCK * BLOCK_SIZE;
+    if (fstat(fd, &st) == -1) {
+        return -1;
+    }
+    /*Touching a page past the end of the file would fault, and an existing image that is short is not this disk*/
+    if ((size_t) st.st_size < disk_map_length) {
+        return -1;
+    }
+
+    disk_map = mmap(NULL, disk_map_length, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (disk_map == MAP_FAILED) {
+        disk_map = NULL;
+        return -1;
+    }
+    return 0;
+}
+
+/*-------------------------------------------------*/
+/*Makes everything written so far durable on disk, */
+/*so nothing written later can reach it before.    */
+/*-------------------------------------------------*/
+int sync_disk() {
+    int result;
+
+    drain_disk_queue();
+    /*Nothing was written since the last sync, so there is nothing to wait for*/
+    if (!__atomic_exchange_n(&disk_unsynced, 0, __ATOMIC_ACQ_REL)) {
+        return 0;
+    }
+    if (NULL != disk_map) {
+        result = msync(disk_map, disk_map_length, MS_SYNC);
+    } else {
+        result = fdatasync(fd);
+    }
+    if (0 != result) {
+        __atomic_store_n(&disk_unsynced, 1, __ATOMIC_RELEASE);
+    }
+    return result;
+}
+
+/*---------------------------------------------------------*/
+/*Tells whether anything was written since the last sync,  */
+/*requests still in flight are not counted                 */
+/*---------------------------------------------------------*/
+int disk_needs_sync() {
+    return __atomic_load_n(&disk_unsynced, __ATOMIC_ACQUIRE);
+}
+
 /*---------------------------------------*/
 /*Initializes a disk file filled with 0's*/
 /*---------------------------------------*/
 int init_fresh_disk(char *filename, int block_size, int num_blocks) {
-    int i, j;
+    return init_fresh_disk_flags(filename, block_size, num_blocks, 0);
+}
+
+/*-------------------------------------------------------------*/
+/*Initializes a disk file filled with 0's, using the backend   */
+/*selected by the flags                                        */
+/*-------------------------------------------------------------*/
+int init_fresh_disk_flags(char *filename, int block_size, int num_blocks, int flags) {
+    const off_t size = (off_t) num_blocks * block_size;
 
     BLOCK_SIZE = block_size;
     MAX_BLOCK = num_blocks;
@@ -33,18 +160,31 @@ int init_fresh_disk(char *filename, int block_size, int num_blocks) {
     /*Initializes the random number generator*/
     srand((unsigned int) (time(0)));
     /*Creates a new file*/
-    fp = fopen(filename, "w+b");
+    fd = open(filename, O_RDWR | O_CREAT | O_TRUNC, 0666);
 
-    if (fp == NULL) {
+    if (fd == -1) {
         printf("Could not create new disk file %s\n\n", filename);
         return -1;
     }
 
-    /*Fills the file with 0's to its given size*/
-    for (i = 0; i < MAX_BLOCK; i++) {
-        for (j = 0; j < BLOCK_SIZE; j++) {
-            fputc(0, fp);
-        }
+    /*Sizes the file without writing it, the file system reads unwritten ranges of a sparse file as 0's*/
+    if (ftruncate(fd, size) == -1) {
+        printf("Could not size disk file %s\n\n", filename);
+        close_disk();
+        return -1;
+    }
+
+    /*Reserves the space up front if asked to, a disk without that space behind it is not created*/
+    if ((flags & DISK_PREALLOCATE) && posix_fallocate(fd, 0, size) != 0) {
+        printf("Could not reserve space for disk file %s\n\n", filename);
+        close_disk();
+        return -1;
+    }
+
+    if ((flags & DISK_MMAP) && map_disk() == -1) {
+        printf("Could not map disk file %s\n\n", filename);
+        close_disk();
+        return -1;
     }
     return 0;
 }
@@ -52,16 +192,30 @@ int init_fresh_disk(char *filename, int block_size, int num_blocks) {
 /*Initializes an existing disk*/
 /*----------------------------*/
 int init_disk(char *filename, int block_size, int num_blocks) {
+    return init_disk_flags(filename, block_size, num_blocks, 0);
+}
+
+/*----------------------------------------------------------------*/
+/*Initializes an existing disk, using the backend selected by the */
+/*flags                                                           */
+/*----------------------------------------------------------------*/
+int init_disk_flags(char *filename, int block_size, int num_blocks, int flags) {
     BLOCK_SIZE = block_size;
     MAX_BLOCK = num_blocks;
 
     /*Opens a file*/
-    fp = fopen(filename, "r+b");
+    fd = open(filename, O_RDWR);
 
-    if (fp == NULL) {
+    if (fd == -1) {
         printf("Could not open %s\n\n", filename);
         return -1;
     }
+
+    if ((flags & DISK_MMAP) && map_disk() == -1) {
+        printf("Could not map %s\n\n", filename);
+        close_disk();
+        return -1;
+    }
     return 0;
 }
 
@@ -69,40 +223,26 @@ int init_disk(char *filename, int block_size, int num_blocks) {
 /*Reads a series of blocks from the disk into the buffer             */
 /*-------------------------------------------------------------------*/
 int read_blocks(int start_address, int nblocks, void *buffer) {
-    int i, s;
-    s = 0;
-
-    /*Sets up a temporary buffer*/
-    void *blockRead = (void *) malloc(BLOCK_SIZE);
-
     /*Checks that the data requested is within the range of addresses of the disk*/
     if (start_address + nblocks > MAX_BLOCK) {
         printf("out of bound error %d\n", start_address);
         return -1;
     }
 
-    /*Goto the data requested from the disk*/
-    fseek(fp, start_address * BLOCK_SIZE, SEEK_SET);
-
-    /*For every block requested*/
-    for (i = 0; i < nblocks; ++i) {
-        s++;
-        fread(blockRead, BLOCK_SIZE, 1, fp);
-        memcpy((char *) buffer + (i * BLOCK_SIZE), blockRead, BLOCK_SIZE);
+    if (NULL != disk_map) {
+        memcpy(buffer, disk_map + (size_t) start_address * BLOCK_SIZE, (size_t) nblocks * BLOCK_SIZE);
+        return nblocks;
     }
 
-    free(blockRead);
-    return s;
+    /*Reads every block requested straight into the buffer*/
+    return transfer_blocks(start_address, nblocks, buffer, 0);
 }
 
 /*------------------------------------------------------------------*/
 /*Writes a series of blocks to the disk from the buffer             */
 /*------------------------------------------------------------------*/
 int write_blocks(int start_address, int nblocks, void *buffer) {
-    int i, s;
-    s = 0;
-
-    void *blockWrite = (void *) malloc(BLOCK_SIZE);
+    int result;
 
     /*Checks that the data requested is within the range of addresses of the disk*/
     if (start_address + nblocks > MAX_BLOCK) {
@@ -110,20 +250,245 @@ int write_blocks(int start_address, int nblocks, void *buffer) {
         return -1;
     }
 
-    /*Goto where the data is to be written on the disk*/
-    fseek(fp, start_address * BLOCK_SIZE, SEEK_SET);
+    /*Pause until the latency duration of every block is elapsed*/
+    if (L > 0) {
+        usleep(L * nblocks);
+    }
+
+    if (NULL != disk_map) {
+        memcpy(disk_map + (size_t) start_address * BLOCK_SIZE, buffer, (size_t) nblocks * BLOCK_SIZE);
+        __atomic_store_n(&disk_unsynced, 1, __ATOMIC_RELEASE);
+        return nblocks;
+    }
+
+    /*Writes every block requested straight from the buffer, a write landing during a sync is left for the next one*/
+    result = transfer_blocks(start_address, nblocks, buffer, 1);
+    __atomic_store_n(&disk_unsynced, 1, __ATOMIC_RELEASE);
+    return result;
+}
+
+/*-----------------------------------------------------------------*/
+/*Runs requests from the submission list until the queue is stopped*/
+/*-----------------------------------------------------------------*/
+void *disk_worker(void *arg) {
+    disk_request *request;
+
+    pthread_mutex_lock(&disk_queue_lock);
+    while (1) {
+        while (NULL == submitted_head && !disk_queue_stopping) {
+            pthread_cond_wait(&disk_queue_submitted, &disk_queue_lock);
+        }
+        if (NULL == submitted_head) {
+            break;
+        }
+        request = submitted_head;
+        submitted_head = request->next;
+        if (NULL == submitted_head) {
+            submitted_tail = NULL;
+        }
+        pthread_mutex_unlock(&disk_queue_lock);
+
+        /*The latency of a write is slept here, so it overlaps with the other workers*/
+        if (request->is_write) {
+            request->result = write_blocks(request->start_address, request->nblocks, request->buffer);
+        } else {
+            request->result = read_blocks(request->start_address, request->nblocks, request->buffer);
+        }
+
+        pthread_mutex_lock(&disk_queue_lock);
+        request->next = NULL;
+        if (NULL == completed_tail) {
+            completed_head = request;
+        } else {
+            completed_tail->next = request;
+        }
+        completed_tail = request;
+        disk_requests_in_flight--;
+        pthread_cond_broadcast(&disk_queue_completed);
+    }
+    pthread_mutex_unlock(&disk_queue_lock);
+    return arg;
+}
+
+/*-------------------------------------------------------------------*/
+/*Waits for the requests in flight and holds the queue across a fork, */
+/*so the child does not inherit requests that nothing will run        */
+/*-------------------------------------------------------------------*/
+void disk_queue_prepare_fork() {
+    pthread_mutex_lock(&disk_queue_lock);
+    while (disk_requests_in_flight > 0) {
+        pthread_cond_wait(&disk_queue_completed, &disk_queue_lock);
+    }
+}
+
+void disk_queue_parent_fork() {
+    pthread_mutex_unlock(&disk_queue_lock);
+}
+
+/*-------------------------------------------------------------------*/
+/*Only the forking thread exists in the child, so the queue forgets   */
+/*its workers and the next submission starts new ones                 */
+/*-------------------------------------------------------------------*/
+void disk_queue_child_fork() {
+    free(disk_workers);
+    disk_workers = NULL;
+    num_disk_workers = 0;
+    disk_queue_stopping = 0;
+    pthread_cond_init(&disk_queue_submitted, NULL);
+    pthread_cond_init(&disk_queue_completed, NULL);
+    pthread_mutex_unlock(&disk_queue_lock);
+}
+
+void disk_queue_register_fork() {
+    pthread_atfork(disk_queue_prepare_fork, disk_queue_parent_fork, disk_queue_child_fork);
+}
+
+/*-------------------------------------------------------------------*/
+/*Starts the workers of the asynchronous queue, at most depth requests*/
+/*are in flight at once. Submitting starts the queue with defaults.   */
+/*-------------------------------------------------------------------*/
+int start_disk_queue(int num_workers, int depth) {
+    int i;
+
+    pthread_once(&disk_queue_fork_once, disk_queue_register_fork);
+    pthread_mutex_lock(&disk_queue_lock);
+    if (NULL != disk_workers) {
+        pthread_mutex_unlock(&disk_queue_lock);
+        return 0;
+    }
+    num_disk_workers = num_workers > 0 ? num_workers : DEFAULT_DISK_WORKERS;
+    disk_queue_depth = depth > 0 ? depth : DEFAULT_DISK_QUEUE_DEPTH;
+    disk_workers = malloc(sizeof(pthread_t) * num_disk_workers);
+    if (NULL == disk_workers) {
+        pthread_mutex_unlock(&disk_queue_lock);
+        return -1;
+    }
+    for (i = 0; i < num_disk_workers; i++) {
+        if (pthread_create(&disk_workers[i], NULL, disk_worker, NULL) != 0) {
+            break;
+        }
+    }
+    num_disk_workers = i;
+    pthread_mutex_unlock(&disk_queue_lock);
+    if (0 == i) {
+        stop_disk_queue();
+        return -1;
+    }
+    return 0;
+}
+
+/*------------------------------------------------------------------*/
+/*Queues a request, waiting while depth requests are already in     */
+/*flight. The request completes later, see reap_blocks.             */
+/*------------------------------------------------------------------*/
+int submit_blocks(disk_request *request) {
+    if (NULL == disk_workers && start_disk_queue(0, 0) == -1) {
+        return -1;
+    }
+
+    pthread_mutex_lock(&disk_queue_lock);
+    while (disk_requests_in_flight >= disk_queue_depth) {
+        pthread_cond_wait(&disk_queue_completed, &disk_queue_lock);
+    }
+    request->next = NULL;
+    if (NULL == submitted_tail) {
+        submitted_head = request;
+    } else {
+        submitted_tail->next = request;
+    }
+    submitted_tail = request;
+    disk_requests_in_flight++;
+    pthread_cond_signal(&disk_queue_submitted);
+    pthread_mutex_unlock(&disk_queue_lock);
+    return 0;
+}
 
-    /*For every block requested*/
-    for (i = 0; i < nblocks; ++i) {
-        /*Pause until the latency duration is elapsed*/
-        usleep(L);
+/*------------------------------------------------------------------*/
+/*Takes up to max completed requests that match, in the order they  */
+/*completed, leaving the others for their own submitters. Waits     */
+/*until at least min are taken, or nothing is left in flight.        */
+/*------------------------------------------------------------------*/
+int reap_completed(disk_request **completed, int max, int min, int match_all, void *user_data) {
+    disk_request **link;
+    int n = 0;
 
-        memcpy(blockWrite, (char *) buffer + (i * BLOCK_SIZE), BLOCK_SIZE);
+    pthread_mutex_lock(&disk_queue_lock);
+    while (n < max) {
+        completed_tail = NULL;
+        for (link = &completed_head; NULL != *link && n < max;) {
+            if (match_all || (*link)->user_data == user_data) {
+                completed[n++] = *link;
+                *link = (*link)->next;
+            } else {
+                completed_tail = *link;
+                link = &(*link)->next;
+            }
+        }
+        /*Stopping early leaves requests past the link, so the tail is found again*/
+        for (; NULL != *link; link = &(*link)->next) {
+            completed_tail = *link;
+        }
+        if (n >= min || 0 == disk_requests_in_flight) {
+            break;
+        }
+        pthread_cond_wait(&disk_queue_completed, &disk_queue_lock);
+    }
+    pthread_mutex_unlock(&disk_queue_lock);
+    return n;
+}
 
-        fwrite(blockWrite, BLOCK_SIZE, 1, fp);
-        fflush(fp);
-        s++;
+/*-----------------------------------------------------------------*/
+/*Takes up to max completed requests, in the order they completed.  */
+/*Waits until at least min are taken, or nothing is left in flight. */
+/*-----------------------------------------------------------------*/
+int reap_blocks(disk_request **completed, int max, int min) {
+    return reap_completed(completed, max, min, 1, NULL);
+}
+
+/*------------------------------------------------------------------*/
+/*Like reap_blocks, but only takes the requests submitted with the  */
+/*given user_data, so several submitters can share the queue        */
+/*------------------------------------------------------------------*/
+int reap_blocks_matching(disk_request **completed, int max, int min, void *user_data) {
+    return reap_completed(completed, max, min, 0, user_data);
+}
+
+/*-------------------------------------------------------------*/
+/*Waits until every submitted request has completed, completed */
+/*requests are left for reap_blocks                            */
+/*-------------------------------------------------------------*/
+int drain_disk_queue() {
+    pthread_mutex_lock(&disk_queue_lock);
+    while (disk_requests_in_flight > 0) {
+        pthread_cond_wait(&disk_queue_completed, &disk_queue_lock);
     }
-    free(blockWrite);
-    return s;
+    pthread_mutex_unlock(&disk_queue_lock);
+    return 0;
+}
+
+/*-------------------------------------------------------*/
+/*Runs the requests still queued and stops the workers   */
+/*-------------------------------------------------------*/
+int stop_disk_queue() {
+    int i;
+
+    pthread_mutex_lock(&disk_queue_lock);
+    if (NULL == disk_workers) {
+        pthread_mutex_unlock(&disk_queue_lock);
+        return 0;
+    }
+    disk_queue_stopping = 1;
+    pthread_cond_broadcast(&disk_queue_submitted);
+    pthread_mutex_unlock(&disk_queue_lock);
+
+    for (i = 0; i < num_disk_workers; i++) {
+        pthread_join(disk_workers[i], NULL);
+    }
+
+    pthread_mutex_lock(&disk_queue_lock);
+    free(disk_workers);
+    disk_workers = NULL;
+    disk_queue_stopping = 0;
+    pthread_mutex_unlock(&disk_queue_lock);
+    return 0;
 }
@@ -1,5 +1,30 @@
+#define DISK_MMAP 0x1        /*Map the whole disk file into memory instead of using file I/O*/
+#define DISK_PREALLOCATE 0x2 /*Reserve the space of a fresh disk file instead of leaving it sparse*/
+
 int init_fresh_disk(char *filename, int block_size, int num_blocks);
+int init_fresh_disk_flags(char *filename, int block_size, int num_blocks, int flags);
 int init_disk(char *filename, int block_size, int num_blocks);
+int init_disk_flags(char *filename, int block_size, int num_blocks, int flags);
 int read_blocks(int start_address, int nblocks, void *buffer);
 int write_blocks(int start_address, int nblocks, void *buffer);
+int sync_disk();
+int disk_needs_sync();
 int close_disk();
+
+/*A request of the asynchronous interface, the caller fills in the transfer and keeps it alive until it is reaped*/
+typedef struct disk_request {
+    int is_write;
+    int start_address;
+    int nblocks;
+    void *buffer;
+    int result;                /*What read_blocks or write_blocks returned, set on completion*/
+    void *user_data;           /*Left alone, so the caller can tell its completions apart*/
+    struct disk_request *next; /*Used by the queue*/
+} disk_request;
+
+int start_disk_queue(int num_workers, int depth);
+int submit_blocks(disk_request *request);
+int reap_blocks(disk_request **completed, int max, int min);
+int reap_blocks_matching(disk_request **completed, int max, int min, void *user_data);
+int drain_disk_queue();
+int stop_disk_queue();
@@ -9,10 +9,85 @@
 #include <sys/stat.h>
 #include <dirent.h>
 #include <errno.h>
+#include <limits.h>
 #include <sys/time.h>
+#include <pthread.h>
 #include "disk_emu.h"
 #include "sfs_api.h"
 
+/* An open SFS file, shared by every FUSE open of the same path, since SFS only lets a file be opened once */
+struct sfs_handle {
+    char name[MAXFILENAME];  /* Empty once the file is unlinked, so later opens get a new handle */
+    int fd;
+    int refs;
+    struct sfs_handle *next;
+};
+
+static struct sfs_handle *handles;
+static pthread_mutex_t handles_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* Get the handle of a path, opening the file if no handle exists yet */
+static struct sfs_handle *acquire_handle(const char *path) {
+    struct sfs_handle *handle;
+    char filename[MAXFILENAME];
+
+    pthread_mutex_lock(&handles_lock);
+    for (handle = handles; handle != NULL; handle = handle->next) {
+        if (strcmp(handle->name, path) == 0) {
+            handle->refs++;
+            pthread_mutex_unlock(&handles_lock);
+            return handle;
+        }
+    }
+
+    handle = malloc(sizeof(struct sfs_handle));
+    if (handle == NULL) {
+        pthread_mutex_unlock(&handles_lock);
+        return NULL;
+    }
+    strcpy(filename, path);
+    handle->fd = sfs_fopen(filename);
+    if (handle->fd == -1) {
+        pthread_mutex_unlock(&handles_lock);
+        free(handle);
+        return NULL;
+    }
+    strcpy(handle->name, path);
+    handle->refs = 1;
+    handle->next = handles;
+    handles = handle;
+    pthread_mutex_unlock(&handles_lock);
+    return handle;
+}
+
+/* Drop a reference to a handle, closing the file once the last one is gone */
+static void release_handle(struct sfs_handle *handle) {
+    struct sfs_handle **link;
+
+    pthread_mutex_lock(&handles_lock);
+    if (--handle->refs > 0) {
+        pthread_mutex_unlock(&handles_lock);
+        return;
+    }
+    for (link = &handles; *link != handle; link = &(*link)->next);
+    *link = handle->next;
+    pthread_mutex_unlock(&handles_lock);
+
+    sfs_fclose(handle->fd);
+    free(handle);
+}
+
+/* Stop a path from matching its handle, with the list locked, the file stays open until the handle is released */
+static void detach_handle(const char *path) {
+    struct sfs_handle *handle;
+
+    for (handle = handles; handle != NULL; handle = handle->next) {
+        if (strcmp(handle->name, path) == 0) {
+            handle->name[0] = '\0';
+        }
+    }
+}
+
 static int fuse_getattr(const char *path, struct stat *stbuf) {
     int res = 0;
     int size;
@@ -32,9 +107,15 @@ static int fuse_getattr(const char *path, struct stat *stbuf) {
     return res;
 }
 
+/*Number of files listed by each call into SFS*/
+#define READDIR_BATCH 64
+
 static int fuse_readdir(const char *path, void *buf, fuse_fill_dir_t filler,
                         off_t offset, struct fuse_file_info *fi) {
-    char file_name[MAXFILENAME];
+    directory_record_t records[READDIR_BATCH];
+    struct stat stbuf;
+    uint32_t cursor = 0;
+    int n, i;
 
     if (strcmp(path, "/") != 0)
         return -ENOENT;
@@ -42,11 +123,19 @@ static int fuse_readdir(const char *path, void *buf, fuse_fill_dir_t filler,
     filler(buf, ".", NULL, 0);
     filler(buf, "..", NULL, 0);
 
-    while (sfs_getnextfilename(file_name)) {
-        filler(buf, &file_name[1], NULL, 0);
+    /* The listing has its own cursor, so concurrent listings do not disturb each other */
+    /* The FUSE 2 filler only keeps the inode number and the file type, so ls -l still calls getattr per entry */
+    while ((n = sfs_readdirplus(&cursor, records, READDIR_BATCH)) > 0) {
+        for (i = 0; i < n; i++) {
+            memset(&stbuf, 0, sizeof(struct stat));
+            stbuf.st_ino = records[i].inode_num;
+            stbuf.st_mode = S_IFREG | 0666;
+            if (filler(buf, &records[i].file_name[1], &stbuf, 0))
+                return 0;
+        }
     }
 
-    return 0;
+    return n < 0 ? -EIO : 0;
 }
 
 static int fuse_unlink(const char *path) {
@@ -54,88 +143,97 @@ static int fuse_unlink(const char *path) {
     char filename[MAXFILENAME];
 
     strcpy(filename, path);
+    /* SFS keeps a removed file until its last descriptor closes, so the handle goes on using it */
+    /* Holding the list keeps opens of the path from finding the handle before it is detached */
+    pthread_mutex_lock(&handles_lock);
     res = sfs_remove(filename);
-    if (res == -1)
-        return -errno;
+    if (res == 0)
+        detach_handle(path);
+    pthread_mutex_unlock(&handles_lock);
 
-    return 0;
+    return res == -1 ? -ENOENT : 0;
 }
 
 static int fuse_open(const char *path, struct fuse_file_info *fi) {
-    int res;
-    char filename[MAXFILENAME];
+    struct sfs_handle *handle;
 
-    strcpy(filename, path);
+    handle = acquire_handle(path);
+    if (handle == NULL)
+        return -ENOENT;
 
-    res = sfs_fopen(filename);
-    if (res == -1)
-        return -errno;
+    fi->fh = (uint64_t) (uintptr_t) handle;
+    return 0;
+}
 
-    sfs_fclose(res);
+static int fuse_release(const char *path, struct fuse_file_info *fi) {
+    release_handle((struct sfs_handle *) (uintptr_t) fi->fh);
     return 0;
 }
 
 static int fuse_read(const char *path, char *buf, size_t size, off_t offset,
                      struct fuse_file_info *fi) {
-    int fd;
-    int res;
-
-    char filename[MAXFILENAME];
-
-    strcpy(filename, path);
-
-    fd = sfs_fopen(filename);
-    if (fd == -1)
-        return -errno;
-
-    if (sfs_fseek(fd, offset) == -1)
-        return -errno;
-
-    res = sfs_fread(fd, buf, size);
-    if (res == -1)
-        return -errno;
-
-    sfs_fclose(fd);
-    return res;
+    struct sfs_handle *handle = (struct sfs_handle *) (uintptr_t) fi->fh;
+
+    /* SFS offsets are ints, so a read past that range would land somewhere else in the file */
+    if (offset < 0)
+        return -EINVAL;
+    if (offset > INT_MAX)
+        return -EFBIG;
+    /* No file reaches past INT_MAX, so a read of the end of a large file is only cut short */
+    if (size > (size_t) (INT_MAX - offset))
+        size = INT_MAX - offset;
+
+    /* Requests carry their own offset, so they run in parallel on the shared descriptor */
+    return sfs_pread(handle->fd, buf, size, offset);
 }
 
 static int fuse_write(const char *path, const char *buf, size_t size,
                       off_t offset, struct fuse_file_info *fi) {
-    int fd;
+    struct sfs_handle *handle = (struct sfs_handle *) (uintptr_t) fi->fh;
     int res;
 
-    char filename[MAXFILENAME];
+    if (offset < 0)
+        return -EINVAL;
+    if (offset > INT_MAX || size > (size_t) (INT_MAX - offset))
+        return -EFBIG;
 
-    strcpy(filename, path);
+    res = sfs_pwrite(handle->fd, buf, size, offset);
+    if (res == 0 && size > 0)
+        return -ENOSPC;
 
-    fd = sfs_fopen(filename);
-    if (fd == -1)
-        return -errno;
+    return res;
+}
 
-    if (sfs_fseek(fd, offset) == -1)
-        return -errno;
+static int fuse_ftruncate(const char *path, off_t size, struct fuse_file_info *fi) {
+    struct sfs_handle *handle = (struct sfs_handle *) (uintptr_t) fi->fh;
 
-    res = sfs_fwrite(fd, buf, size);
-    if (res == -1)
-        return -errno;
+    if (size < 0)
+        return -EINVAL;
+    if (size > INT_MAX)
+        return -EFBIG;
+    if (sfs_ftruncate(handle->fd, size) == -1)
+        return -ENOSPC;
 
-    sfs_fclose(fd);
-    return res;
+    return 0;
 }
 
 static int fuse_truncate(const char *path, off_t size) {
-    char filename[MAXFILENAME];
-    int fd;
+    struct fuse_file_info fi;
+    struct sfs_handle *handle;
+    int res;
 
-    strcpy(filename, path);
+    /* Opening the file would create it */
+    if (sfs_getfilesize(path) == -1)
+        return -ENOENT;
 
-    fd = sfs_remove(filename);
-    if (fd == -1)
-        return -errno;
+    handle = acquire_handle(path);
+    if (handle == NULL)
+        return -ENOENT;
 
-    fd = sfs_fopen(filename);
-    sfs_fclose(fd);
-    return 0;
+    fi.fh = (uint64_t) (uintptr_t) handle;
+    res = fuse_ftruncate(path, size, &fi);
+    release_handle(handle);
+    return res;
 }
 
 static int fuse_access(const char *path, int mask) {
@@ -147,14 +245,11 @@ static int fuse_mknod(const char *path, mode_t mode, dev_t rdev) {
 }
 
 static int fuse_create(const char *path, mode_t mode, struct fuse_file_info *fp) {
-    char filename[MAXFILENAME];
-    int fd;
-
-    strcpy(filename, path);
-    fd = sfs_fopen(filename);
+    return fuse_open(path, fp);
+}
 
-    sfs_fclose(fd);
-    return 0;
+static void fuse_destroy(void *private_data) {
+    sfs_unmount();
 }
 
 static struct fuse_operations xmp_oper = {
@@ -163,11 +258,14 @@ static struct fuse_operations xmp_oper = {
         .mknod = fuse_mknod,
         .unlink = fuse_unlink,
         .truncate = fuse_truncate,
+        .ftruncate = fuse_ftruncate,
         .open = fuse_open,
+        .release = fuse_release,
         .read = fuse_read,
         .write = fuse_write,
         .access = fuse_access,
         .create = fuse_create,
+        .destroy = fuse_destroy,
 };
 
 int main(int argc, char *argv[]) {
@@ -0,0 +1,634 @@
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include "sfs_api.h"
+#include "block_cache.h"
+#include "disk_emu.h"
+#include "journal.h"
+
+#define CEIL(x, y) ((x + y - 1) / y)
+#define JOURNAL_MAGIC 0x4A524E4C
+#define JOURNAL_SUPER 0       // The first block of the journal, naming the sequence number of the first transaction
+#define JOURNAL_DESCRIPTOR 1  // Lists the home blocks of the block images following it
+#define JOURNAL_REVOKE 2      // Lists blocks that were freed, so older images of them must not be replayed
+#define JOURNAL_COMMIT 3      // Ends a transaction, a transaction without one is ignored
+#define NO_JOURNAL_SLOT UINT32_MAX
+
+// Starts every journal block that is not a block image
+typedef struct journal_header_t {
+    uint32_t magic;
+    uint32_t type;
+    uint32_t sequence;  // The transaction the block belongs to
+    uint32_t count;     // Number of block numbers following the header
+} journal_header_t;
+
+#define JOURNAL_TAGS_PER_BLOCK ((BLOCK_SIZE - sizeof(journal_header_t)) / sizeof(uint32_t))
+
+// Block images by home block, with an open addressing index over them
+typedef struct journal_map_t {
+    uint32_t *blocks;
+    uint8_t *data;
+    uint32_t count;
+    uint32_t capacity;
+    uint32_t *index;
+    uint32_t index_size;  // Always a power of two, at least twice the capacity
+} journal_map_t;
+
+// A block image found in the journal while replaying it
+typedef struct journal_entry_t {
+    uint32_t block;
+    uint32_t position;  // The journal block holding the image
+    uint32_t sequence;
+} journal_entry_t;
+
+bool is_journal_open;
+uint32_t journal_start_block;
+uint32_t journal_num_of_blocks;
+uint32_t journal_sequence;  // Sequence number of the running transaction
+uint32_t journal_head;      // The journal block after the records of the committed transactions
+// Changes made since the last commit, and committed changes that have not been written to their home blocks yet
+journal_map_t running_map;
+journal_map_t checkpoint_map;
+// Blocks freed since the last commit
+uint32_t *revoked_blocks;
+uint32_t num_of_revoked_blocks;
+uint32_t revoked_blocks_capacity;
+// Operations in progress, a commit waits for them so it never holds half an operation
+uint32_t active_ops;
+bool is_committing;
+pthread_mutex_t journal_lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t journal_cond = PTHREAD_COND_INITIALIZER;
+
+/**
+ * Get the slot of the index holding a block, or the empty slot where it would go.
+ * @param map The map to look in.
+ * @param block The home block.
+ * @return The index slot.
+ */
+uint32_t map_slot(const journal_map_t *const map, uint32_t block) {
+    uint32_t slot = (block * 2654435761u) & (map->index_size - 1);
+    while (map->index[slot] != NO_JOURNAL_SLOT && map->blocks[map->index[slot]] != block) {
+        slot = (slot + 1) & (map->index_size - 1);
+    }
+    return slot;
+}
+
+/**
+ * Find the image of a block in a map.
+ * @param map The map to look in.
+ * @param block The home block.
+ * @return The image, NULL if the map does not hold the block.
+ */
+uint8_t *map_find(const journal_map_t *const map, uint32_t block) {
+    if (map->count == 0) {
+        return NULL;
+    }
+    const uint32_t idx = map->index[map_slot(map, block)];
+    return idx == NO_JOURNAL_SLOT ? NULL : map->data + ((size_t) idx * BLOCK_SIZE);
+}
+
+/**
+ * Index every image of a map again.
+ * @param map The map.
+ */
+void map_rebuild_index(journal_map_t *const map) {
+    for (uint32_t i = 0; i < map->index_size; ++i) {
+        map->index[i] = NO_JOURNAL_SLOT;
+    }
+    for (uint32_t i = 0; i < map->count; ++i) {
+        map->index[map_slot(map, map->blocks[i])] = i;
+    }
+}
+
+/**
+ * Store the image of a block in a map, replacing any image of it that the map holds.
+ * @param map The map.
+ * @param block The home block.
+ * @param data The image.
+ * @return True if successful, false if unsuccessful.
+ */
+bool map_put(journal_map_t *const map, uint32_t block, const void *const data) {
+    uint8_t *const image = map_find(map, block);
+    if (image != NULL) {
+        memcpy(image, data, BLOCK_SIZE);
+        return true;
+    }
+    if (map->count == map->capacity) {
+        const uint32_t capacity = map->capacity > 0 ? map->capacity * 2 : 64;
+        uint32_t *const blocks = realloc(map->blocks, capacity * sizeof(uint32_t));
+        if (blocks == NULL) {
+            return false;
+        }
+        map->blocks = blocks;
+        uint8_t *const images = realloc(map->data, (size_t) capacity * BLOCK_SIZE);
+        if (images == NULL) {
+            return false;
+        }
+        map->data = images;
+        uint32_t *const index = realloc(map->index, capacity * 2 * sizeof(uint32_t));
+        if (index == NULL) {
+            return false;
+        }
+        map->index = index;
+        map->capacity = capacity;
+        map->index_size = capacity * 2;
+        map_rebuild_index(map);
+    }
+    map->blocks[map->count] = block;
+    memcpy(map->data + ((size_t) map->count * BLOCK_SIZE), data, BLOCK_SIZE);
+    map->index[map_slot(map, block)] = map->count;
+    map->count++;
+    return true;
+}
+
+/**
+ * Drop the image of a block from a map, moving the last image into its place.
+ * @param map The map.
+ * @param block The home block.
+ */
+void map_remove(journal_map_t *const map, uint32_t block) {
+    if (map->count == 0) {
+        return;
+    }
+    const uint32_t idx = map->index[map_slot(map, block)];
+    if (idx == NO_JOURNAL_SLOT) {
+        return;
+    }
+    map->count--;
+    if (idx != map->count) {
+        map->blocks[idx] = map->blocks[map->count];
+        memcpy(map->data + ((size_t) idx * BLOCK_SIZE), map->data + ((size_t) map->count * BLOCK_SIZE), BLOCK_SIZE);
+    }
+    map_rebuild_index(map);
+}
+
+/**
+ * Drop every image of a map, keeping its memory for later use.
+ * @param map The map.
+ */
+void map_clear(journal_map_t *const map) {
+    map->count = 0;
+    map_rebuild_index(map);
+}
+
+/**
+ * Write back everything cached and wait until the disk holds it, so no later write can reach the disk before it.
+ * @return 0 if successful, -1 otherwise.
+ */
+int journal_barrier() {
+    if (block_cache_flush() < 0) {
+        return -1;
+    }
+    return sync_disk() < 0 ? -1 : 0;
+}
+
+/**
+ * Write the first block of the journal, which makes every record before the head stale.
+ * @return 0 if successful, -1 otherwise.
+ */
+int write_journal_super() {
+    uint8_t buf[BLOCK_SIZE] = {0};
+    const journal_header_t header = {JOURNAL_MAGIC, JOURNAL_SUPER, journal_sequence, 0};
+    memcpy(buf, &header, sizeof(journal_header_t));
+    cache_write_blocks(journal_start_block, 1, buf);
+    return journal_barrier();
+}
+
+/**
+ * Write every committed change to its home block and empty the journal, with the journal lock held.
+ * @return 0 if successful, -1 otherwise.
+ */
+int checkpoint_locked() {
+    for (uint32_t i = 0; i < checkpoint_map.count; ++i) {
+        cache_write_blocks(checkpoint_map.blocks[i], 1, checkpoint_map.data + ((size_t) i * BLOCK_SIZE));
+    }
+    // The home blocks must be on the disk before the records that would replay them are dropped
+    if (journal_barrier() < 0) {
+        return -1;
+    }
+    map_clear(&checkpoint_map);
+    journal_head = 1;
+    return write_journal_super();
+}
+
+/**
+ * Fill in a descriptor, revoke or commit block.
+ * @param buf The block to fill in.
+ * @param type The type of the block.
+ * @param tags The block numbers to list.
+ * @param count The number of block numbers to list.
+ */
+void fill_journal_block(uint8_t *const buf, uint32_t type, const uint32_t *const tags, uint32_t count) {
+    const journal_header_t header = {JOURNAL_MAGIC, type, journal_sequence, count};
+    memset(buf, 0, BLOCK_SIZE);
+    memcpy(buf, &header, sizeof(journal_header_t));
+    if (count > 0) {
+        memcpy(buf + sizeof(journal_header_t), tags, count * sizeof(uint32_t));
+    }
+}
+
+/**
+ * Write the running transaction to the journal as a single sequential record, with the journal lock held.
+ * Data blocks are written back first, so committed metadata never points at data that is not on the disk.
+ * @return 0 if successful, -1 otherwise.
+ */
+int commit_locked() {
+    // Nothing changed since the last commit, so there is nothing to make durable
+    if (running_map.count == 0 && num_of_revoked_blocks == 0 && !block_cache_is_dirty() && !disk_needs_sync()) {
+        return 0;
+    }
+    int result = journal_barrier();
+    if (running_map.count == 0 && num_of_revoked_blocks == 0) {
+        return result;
+    }
+
+    const uint32_t num_of_descriptors = CEIL(running_map.count, JOURNAL_TAGS_PER_BLOCK);
+    const uint32_t num_of_revoke_blocks = CEIL(num_of_revoked_blocks, JOURNAL_TAGS_PER_BLOCK);
+    const uint32_t total = num_of_descriptors + running_map.count + num_of_revoke_blocks + 1;
+    if (journal_head + total > journal_num_of_blocks && checkpoint_locked() < 0) {
+        result = -1;
+    }
+
+    uint8_t *const record = journal_head + total <= journal_num_of_blocks
+                            ? malloc((size_t) total * BLOCK_SIZE) : NULL;
+    if (record == NULL) {
+        // The transaction does not fit in the journal, or there is no memory to build its record,
+        // so it can only be written to its home blocks. The journal is emptied first, or the older images
+        // it holds of those blocks would be read, checkpointed or replayed over the newer home blocks
+        if (journal_head > 1 && checkpoint_locked() < 0) {
+            result = -1;
+        }
+        for (uint32_t i = 0; i < running_map.count; ++i) {
+            map_remove(&checkpoint_map, running_map.blocks[i]);
+            cache_write_blocks(running_map.blocks[i], 1, running_map.data + ((size_t) i * BLOCK_SIZE));
+        }
+        if (journal_barrier() < 0) {
+            result = -1;
+        }
+    } else {
+        uint32_t position = 0;
+        for (uint32_t i = 0; i < running_map.count; i += JOURNAL_TAGS_PER_BLOCK) {
+            const uint32_t count = running_map.count - i < JOURNAL_TAGS_PER_BLOCK
+                                   ? running_map.count - i : JOURNAL_TAGS_PER_BLOCK;
+            fill_journal_block(record + ((size_t) position++ * BLOCK_SIZE), JOURNAL_DESCRIPTOR,
+                               running_map.blocks + i, count);
+            memcpy(record + ((size_t) position * BLOCK_SIZE), running_map.data + ((size_t) i * BLOCK_SIZE),
+                   (size_t) count * BLOCK_SIZE);
+            position += count;
+        }
+        for (uint32_t i = 0; i < num_of_revoked_blocks; i += JOURNAL_TAGS_PER_BLOCK) {
+            const uint32_t count = num_of_revoked_blocks - i < JOURNAL_TAGS_PER_BLOCK
+                                   ? num_of_revoked_blocks - i : JOURNAL_TAGS_PER_BLOCK;
+            fill_journal_block(record + ((size_t) position++ * BLOCK_SIZE), JOURNAL_REVOKE,
+                               revoked_blocks + i, count);
+        }
+        fill_journal_block(record + ((size_t) position * BLOCK_SIZE), JOURNAL_COMMIT, NULL, 0);
+        // The commit block is written once the rest of the record is on the disk,
+        // so a record cut short by a crash is never taken as committed
+        if (cache_write_blocks(journal_start_block + journal_head, total - 1, record) < 0 || journal_barrier() < 0) {
+            result = -1;
+        }
+        // The commit block must be on the disk before any home block is overwritten
+        if (cache_write_blocks(journal_start_block + journal_head + total - 1, 1,
+                               record + ((size_t) (total - 1) * BLOCK_SIZE)) < 0 || journal_barrier() < 0) {
+            result = -1;
+        }
+        free(record);
+        journal_head += total;
+
+        // The committed images are written to their home blocks at the next checkpoint
+        for (uint32_t i = 0; i < running_map.count; ++i) {
+            if (!map_put(&checkpoint_map, running_map.blocks[i], running_map.data + ((size_t) i * BLOCK_SIZE))) {
+                // The home block now holds the newest image, so no older one may be written over it later
+                map_remove(&checkpoint_map, running_map.blocks[i]);
+                cache_write_blocks(running_map.blocks[i], 1, running_map.data + ((size_t) i * BLOCK_SIZE));
+            }
+        }
+        // Replay expects the records to carry consecutive sequence numbers, so only a written record uses one up
+        journal_sequence++;
+    }
+
+    map_clear(&running_map);
+    num_of_revoked_blocks = 0;
+    return result;
+}
+
+/**
+ * Check whether a block is revoked by a transaction after a given one.
+ * @param revokes The revoked blocks found in the journal, with the transaction that revoked them.
+ * @param num_of_revokes The number of revoked blocks.
+ * @param block The block to check.
+ * @param sequence The transaction holding an image of the block.
+ * @return True if the image must not be replayed, false otherwise.
+ */
+bool is_revoked_after(const journal_entry_t *const revokes, uint32_t num_of_revokes, uint32_t block,
+                      uint32_t sequence) {
+    for (uint32_t i = 0; i < num_of_revokes; ++i) {
+        if (revokes[i].block == block && revokes[i].sequence > sequence) {
+            return true;
+        }
+    }
+    return false;
+}
+
+/**
+ * Write every committed transaction found in the journal to its home blocks.
+ * Images of blocks revoked by a later transaction are skipped, since those blocks may hold data by now.
+ * @return 0 if successful, -1 otherwise.
+ */
+int replay_journal() {
+    uint8_t buf[BLOCK_SIZE];
+    journal_header_t header;
+    cache_read_blocks(journal_start_block, 1, buf);
+    memcpy(&header, buf, sizeof(journal_header_t));
+    if (header.magic != JOURNAL_MAGIC || header.type != JOURNAL_SUPER) {
+        return -1;
+    }
+
+    // Every image takes a journal block, revoked blocks are listed in as many of them as the journal holds
+    journal_entry_t *const entries = malloc(journal_num_of_blocks * sizeof(journal_entry_t));
+    journal_entry_t *revokes = NULL;
+    uint32_t revokes_capacity = 0;
+    if (entries == NULL) {
+        return -1;
+    }
+    uint32_t num_of_entries = 0;
+    uint32_t num_of_revokes = 0;
+    uint32_t sequence = header.sequence;
+    uint32_t position = 1;
+    // Scan one transaction at a time, keeping its entries only once its commit block is found
+    while (true) {
+        uint32_t scan = position;
+        uint32_t tx_entries = num_of_entries;
+        uint32_t tx_revokes = num_of_revokes;
+        bool is_committed = false;
+        while (scan < journal_num_of_blocks) {
+            uint32_t tags[JOURNAL_TAGS_PER_BLOCK];
+            cache_read_blocks(journal_start_block + scan, 1, buf);
+            memcpy(&header, buf, sizeof(journal_header_t));
+            if (header.magic != JOURNAL_MAGIC || header.sequence != sequence || header.count > JOURNAL_TAGS_PER_BLOCK) {
+                break;
+            }
+            scan++;
+            if (header.type == JOURNAL_COMMIT) {
+                is_committed = true;
+                break;
+            }
+            memcpy(tags, buf + sizeof(journal_header_t), header.count * sizeof(uint32_t));
+            if (header.type == JOURNAL_DESCRIPTOR) {
+                for (uint32_t i = 0; i < header.count && scan < journal_num_of_blocks; ++i) {
+                    entries[tx_entries++] = (journal_entry_t) {tags[i], scan++, sequence};
+                }
+            } else if (header.type == JOURNAL_REVOKE) {
+                if (tx_revokes + header.count > revokes_capacity) {
+                    revokes_capacity = (tx_revokes + header.count) * 2;
+                    journal_entry_t *const grown = realloc(revokes, revokes_capacity * sizeof(journal_entry_t));
+                    if (grown == NULL) {
+                        free(entries);
+                        free(revokes);
+                        return -1;
+                    }
+                    revokes = grown;
+                }
+                for (uint32_t i = 0; i < header.count; ++i) {
+                    revokes[tx_revokes++] = (journal_entry_t) {tags[i], scan, sequence};
+                }
+            } else {
+                break;
+            }
+        }
+        if (!is_committed) {
+            break;
+        }
+        num_of_entries = tx_entries;
+        num_of_revokes = tx_revokes;
+        position = scan;
+        sequence++;
+    }
+
+    for (uint32_t i = 0; i < num_of_entries; ++i) {
+        if (!is_revoked_after(revokes, num_of_revokes, entries[i].block, entries[i].sequence)) {
+            cache_read_blocks(journal_start_block + entries[i].position, 1, buf);
+            cache_write_blocks(entries[i].block, 1, buf);
+        }
+    }
+    free(entries);
+    free(revokes);
+
+    journal_sequence = sequence;
+    journal_head = 1;
+    if (journal_barrier() < 0) {
+        return -1;
+    }
+    return write_journal_super();
+}
+
+/**
+ * Start using the journal region of a disk.
+ * @param start The first block of the journal region.
+ * @param num_of_blocks The number of blocks in the journal region.
+ * @param fresh True to start an empty journal, false to replay the journal found on the disk first.
+ * @return 0 if successful, -1 otherwise.
+ */
+int journal_open(uint32_t start, uint32_t num_of_blocks, bool fresh) {
+    pthread_mutex_lock(&journal_lock);
+    journal_start_block = start;
+    journal_num_of_blocks = num_of_blocks;
+    journal_head = 1;
+    map_clear(&running_map);
+    map_clear(&checkpoint_map);
+    num_of_revoked_blocks = 0;
+    int result;
+    if (fresh) {
+        journal_sequence = 1;
+        result = write_journal_super();
+    } else {
+        result = replay_journal();
+    }
+    is_journal_open = result == 0;
+    pthread_mutex_unlock(&journal_lock);
+    return result;
+}
+
+/**
+ * Commit the running transaction and write everything in the journal to its home blocks, then stop using it.
+ * @return 0 if successful, -1 otherwise.
+ */
+int journal_close() {
+    if (!is_journal_open) {
+        return 0;
+    }
+    int result = journal_commit();
+    if (journal_checkpoint() < 0) {
+        result = -1;
+    }
+    pthread_mutex_lock(&journal_lock);
+    is_journal_open = false;
+    pthread_mutex_unlock(&journal_lock);
+    return result;
+}
+
+/**
+ * Start an operation, whose changes will be committed together.
+ * This must be called before taking any file system lock, since it waits for a commit in progress.
+ */
+void journal_start() {
+    pthread_mutex_lock(&journal_lock);
+    while (is_committing) {
+        pthread_cond_wait(&journal_cond, &journal_lock);
+    }
+    active_ops++;
+    pthread_mutex_unlock(&journal_lock);
+}
+
+/**
+ * End an operation, committing the running transaction if it grew large.
+ * This must be called after releasing every file system lock.
+ */
+void journal_stop() {
+    pthread_mutex_lock(&journal_lock);
+    active_ops--;
+    if (active_ops == 0) {
+        pthread_cond_broadcast(&journal_cond);
+    }
+    const bool is_large = running_map.count >= JOURNAL_COMMIT_BLOCKS;
+    pthread_mutex_unlock(&journal_lock);
+    if (is_large) {
+        journal_commit();
+    }
+}
+
+/**
+ * Read a series of metadata blocks, taking blocks changed since the last checkpoint from the journal.
+ * @param start_address The first block to read.
+ * @param nblocks The number of blocks to read.
+ * @param buffer The buffer to read into.
+ * @return The number of blocks read if successful, -1 otherwise.
+ */
+int journal_read_blocks(uint32_t start_address, uint32_t nblocks, void *buffer) {
+    pthread_mutex_lock(&journal_lock);
+    if (!is_journal_open || (running_map.count == 0 && checkpoint_map.count == 0)) {
+        pthread_mutex_unlock(&journal_lock);
+        return cache_read_blocks(start_address, nblocks, buffer);
+    }
+    uint32_t i = 0;
+    while (i < nblocks) {
+        const uint8_t *image = map_find(&running_map, start_address + i);
+        if (image == NULL) {
+            image = map_find(&checkpoint_map, start_address + i);
+        }
+        if (image != NULL) {
+            memcpy((uint8_t *) buffer + ((size_t) i * BLOCK_SIZE), image, BLOCK_SIZE);
+            i++;
+            continue;
+        }
+        // Read the whole run of blocks that are not in the journal at once
+        uint32_t run = 1;
+        while (i + run < nblocks && map_find(&running_map, start_address + i + run) == NULL
+               && map_find(&checkpoint_map, start_address + i + run) == NULL) {
+            run++;
+        }
+        if (cache_read_blocks(start_address + i, run, (uint8_t *) buffer + ((size_t) i * BLOCK_SIZE)) < 0) {
+            pthread_mutex_unlock(&journal_lock);
+            return -1;
+        }
+        i += run;
+    }
+    pthread_mutex_unlock(&journal_lock);
+    return (int) nblocks;
+}
+
+/**
+ * Write a series of metadata blocks into the running transaction.
+ * They reach the journal at the next commit and their home blocks at the checkpoint after that.
+ * @param start_address The first block to write.
+ * @param nblocks The number of blocks to write.
+ * @param buffer The buffer to write from.
+ * @return The number of blocks written if successful, -1 otherwise.
+ */
+int journal_write_blocks(uint32_t start_address, uint32_t nblocks, const void *buffer) {
+    pthread_mutex_lock(&journal_lock);
+    if (!is_journal_open) {
+        pthread_mutex_unlock(&journal_lock);
+        return cache_write_blocks(start_address, nblocks, buffer);
+    }
+    for (uint32_t i = 0; i < nblocks; ++i) {
+        const uint32_t block = start_address + i;
+        if (!map_put(&running_map, block, (const uint8_t *) buffer + ((size_t) i * BLOCK_SIZE))) {
+            pthread_mutex_unlock(&journal_lock);
+            return -1;
+        }
+        // A block written again after being freed is metadata again
+        for (uint32_t j = 0; j < num_of_revoked_blocks; ++j) {
+            if (revoked_blocks[j] == block) {
+                revoked_blocks[j] = revoked_blocks[--num_of_revoked_blocks];
+                break;
+            }
+        }
+    }
+    pthread_mutex_unlock(&journal_lock);
+    return (int) nblocks;
+}
+
+/**
+ * Forget a freed metadata block, so no image of it is written over the data it may hold next.
+ * @param block The freed block.
+ */
+void journal_revoke(uint32_t block) {
+    pthread_mutex_lock(&journal_lock);
+    if (!is_journal_open) {
+        pthread_mutex_unlock(&journal_lock);
+        return;
+    }
+    map_remove(&running_map, block);
+    map_remove(&checkpoint_map, block);
+    if (num_of_revoked_blocks == revoked_blocks_capacity) {
+        const uint32_t capacity = revoked_blocks_capacity > 0 ? revoked_blocks_capacity * 2 : 64;
+        uint32_t *const blocks = realloc(revoked_blocks, capacity * sizeof(uint32_t));
+        if (blocks == NULL) {
+            pthread_mutex_unlock(&journal_lock);
+            return;
+        }
+        revoked_blocks = blocks;
+        revoked_blocks_capacity = capacity;
+    }
+    revoked_blocks[num_of_revoked_blocks++] = block;
+    pthread_mutex_unlock(&journal_lock);
+}
+
+/**
+ * Commit the running transaction, once the operations in progress have ended.
+ * Operations from every thread since the last commit go out together in one record.
+ * @return 0 if successful, -1 otherwise.
+ */
+int journal_commit() {
+    pthread_mutex_lock(&journal_lock);
+    if (!is_journal_open) {
+        pthread_mutex_unlock(&journal_lock);
+        return block_cache_flush();
+    }
+    while (is_committing) {
+        pthread_cond_wait(&journal_cond, &journal_lock);
+    }
+    is_committing = true;
+    while (active_ops > 0) {
+        pthread_cond_wait(&journal_cond, &journal_lock);
+    }
+    const int result = commit_locked();
+    is_committing = false;
+    pthread_cond_broadcast(&journal_cond);
+    pthread_mutex_unlock(&journal_lock);
+    return result;
+}
+
+/**
+ * Write every committed change to its home blocks and empty the journal.
+ * @return 0 if successful, -1 otherwise.
+ */
+int journal_checkpoint() {
+    pthread_mutex_lock(&journal_lock);
+    const int result = is_journal_open ? checkpoint_locked() : 0;
+    pthread_mutex_unlock(&journal_lock);
+    return result;
+}
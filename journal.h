@@ -0,0 +1,27 @@
+#ifndef JOURNAL_H
+#define JOURNAL_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#define JOURNAL_COMMIT_BLOCKS 512 // Size the running transaction may reach before the end of an operation commits it
+
+int journal_open(uint32_t start, uint32_t num_of_blocks, bool fresh);
+
+int journal_close();
+
+void journal_start();
+
+void journal_stop();
+
+int journal_read_blocks(uint32_t start_address, uint32_t nblocks, void *buffer);
+
+int journal_write_blocks(uint32_t start_address, uint32_t nblocks, const void *buffer);
+
+void journal_revoke(uint32_t block);
+
+int journal_commit();
+
+int journal_checkpoint();
+
+#endif
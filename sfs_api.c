@@ -1,196 +1,899 @@
+#include <limits.h>
+#include <pthread.h>
 #include <string.h>
 #include <stdlib.h>
 #include "sfs_api.h"
 #include "disk_emu.h"
+#include "block_cache.h"
+#include "journal.h"
 
 // https://stackoverflow.com/questions/2745074/fast-ceiling-of-an-integer-division-in-c-c
 // This is used for when ceiling division is needed
 #define CEIL(x, y) ((x + y - 1) / y)
 
 #define DISK_NAME "sfs_disk_miguel.disk"
-#define NUM_OF_DATA_BLOCKS (1024 * 16)
-#define NUM_OF_INODES NUM_OF_DATA_BLOCKS // At most one inode is needed for each possible file
-#define NUM_OF_INODE_BLOCKS (CEIL(NUM_OF_INODES, BLOCK_SIZE) * sizeof(inode_t))
-#define INODE_BLOCKS_OFFSET 1
-#define DATA_BLOCKS_OFFSET (INODE_BLOCKS_OFFSET + NUM_OF_INODE_BLOCKS)
-#define FREE_BITMAP_OFFSET (DATA_BLOCKS_OFFSET + NUM_OF_DATA_BLOCKS)
-#define NUM_OF_FREE_BITMAP_BYTES CEIL(NUM_OF_DATA_BLOCKS, 8) // 8 bits in each byte
-#define NUM_OF_FREE_BITMAP_BLOCKS CEIL(NUM_OF_FREE_BITMAP_BYTES, BLOCK_SIZE)
-// Number of blocks needed to store -> super block + inode table + data blocks + free bitmap
-#define TOTAL_NUM_OF_BLOCKS (FREE_BITMAP_OFFSET + NUM_OF_FREE_BITMAP_BLOCKS)
-#define MAX_DATA_BLOCKS_FOR_FILE (NUM_OF_DATA_PTRS + INDIRECT_LIST_SIZE) // 12 direct pointers + the amount of indirect pointers possible
+#ifndef SFS_DISK_FLAGS
+#define SFS_DISK_FLAGS 0 // Build with -DSFS_DISK_FLAGS=DISK_MMAP to use the memory mapped disk backend, see disk_emu.h
+#endif
+#define DEFAULT_NUM_OF_DATA_BLOCKS (1024 * 16)
+#define DEFAULT_NUM_OF_INODES DEFAULT_NUM_OF_DATA_BLOCKS // At most one inode is needed for each possible file
+#define MAX_NUM_OF_INODES (1u << 30) // Keeps the size of the directory index within 32 bits
+#define SUPER_BLOCK_MAGIC 0xACBD0006 // Changed from 0xACBD0005 with the journal, the geometry fields and the on-disk indexes
+#define JOURNAL_OFFSET 1
+#define NUM_OF_JOURNAL_BLOCKS 2048
+// The geometry of the mounted disk, which is chosen when it is created and read back from its super block
+#define NUM_OF_DATA_BLOCKS super_block.num_of_data_blocks
+#define NUM_OF_INODES super_block.num_of_inodes
+#define NUM_OF_INODE_BLOCKS super_block.inode_table_length
+#define INODE_BLOCKS_OFFSET super_block.inode_table_start
+#define DATA_BLOCKS_OFFSET super_block.data_blocks_start
+#define FREE_BITMAP_OFFSET super_block.free_bitmap_start
+#define NUM_OF_FREE_BITMAP_BLOCKS super_block.free_bitmap_length
+#define INODE_BITMAP_OFFSET super_block.inode_bitmap_start
+#define NUM_OF_INODE_BITMAP_BLOCKS super_block.inode_bitmap_length
+#define DIR_INDEX_OFFSET super_block.dir_index_start
+#define NUM_OF_DIR_INDEX_BLOCKS super_block.dir_index_length
+// Number of blocks needed to store -> super block + journal + inode table + data blocks + free bitmap + inode bitmap
+// + directory index
+#define TOTAL_NUM_OF_BLOCKS super_block.file_sys_size
+#define NUM_OF_DOUBLE_INDIRECT_PTRS (INDIRECT_LIST_SIZE * INDIRECT_LIST_SIZE)
+#define NUM_OF_TRIPLE_INDIRECT_PTRS (NUM_OF_DOUBLE_INDIRECT_PTRS * INDIRECT_LIST_SIZE)
+// The first block of a file reached through the double and the triple indirect pointers
+#define DOUBLE_INDIRECT_START (NUM_OF_DATA_PTRS + INDIRECT_LIST_SIZE)
+#define TRIPLE_INDIRECT_START (DOUBLE_INDIRECT_START + NUM_OF_DOUBLE_INDIRECT_PTRS)
+// 12 direct pointers + the amount of indirect, double indirect and triple indirect pointers possible
+#define MAX_DATA_BLOCKS_FOR_FILE (TRIPLE_INDIRECT_START + NUM_OF_TRIPLE_INDIRECT_PTRS)
+#define MAX_FILE_SIZE (INT_MAX / BLOCK_SIZE * BLOCK_SIZE) // Largest size, in whole blocks, that the int sizes and offsets of the API can reach
 #define MAX_NUM_OF_DIR_ENTRIES (NUM_OF_INODES - 1)
-#define FREE_BLOCK_MAP_ARR_SIZE CEIL(NUM_OF_FREE_BITMAP_BYTES, sizeof(int))
+#define BITS_PER_MAP_WORD (sizeof(uint64_t) * 8)
+// The free bitmap array covers every bitmap block, so whole blocks can be read into it
+#define FREE_BLOCK_MAP_ARR_SIZE (NUM_OF_FREE_BITMAP_BLOCKS * BLOCK_SIZE / sizeof(uint64_t))
+#define FREE_INODE_MAP_ARR_SIZE (NUM_OF_INODE_BITMAP_BLOCKS * BLOCK_SIZE / sizeof(uint64_t))
+#define DIR_INDEX_EMPTY MAX_NUM_OF_DIR_ENTRIES
+#define DIR_SLOTS_PER_BLOCK (BLOCK_SIZE / sizeof(dir_slot_t))
+#define NUM_OF_DIR_SLOTS (NUM_OF_DIR_INDEX_BLOCKS * DIR_SLOTS_PER_BLOCK) // Power of two at least twice MAX_NUM_OF_DIR_ENTRIES
+#define BLOCK_BATCH_SIZE INDIRECT_LIST_SIZE // Number of data block numbers looked up at a time when transferring file data
+#define INODE_LOCK_STRIPES 64 // Number of inode locks, inodes share the lock of their number modulo this
+#define INODES_PER_BLOCK (BLOCK_SIZE / sizeof(inode_t))
+#define MAX_RESIDENT_INODE_PAGES 1024 // Inode table blocks kept in memory before unused ones are evicted
+#define INODE_INIT_BLOCKS 16 // Number of inode table blocks written at a time when creating the file system
+// Sizes the tables start at, they double each time they run out of room
+#define MIN_FILE_DESC_TABLE_SIZE 16
+// Directory entries are packed into the blocks of the root directory so that no entry straddles two blocks
+#define DIR_ENTRIES_PER_BLOCK (BLOCK_SIZE / sizeof(directory_entry_t))
+
+// A pointer block held in memory while pointers are added to it
+typedef struct pointer_block_t {
+    uint32_t block;
+    bool dirty;
+    uint32_t ptrs[INDIRECT_LIST_SIZE];
+} pointer_block_t;
+
+// A slot of the directory index, which is an open addressing hash table on the disk
+typedef struct dir_slot_t {
+    uint32_t hash;  // Hash of the file name of the entry, so that probing rarely has to read the entry
+    uint32_t entry; // Index of the entry in the root directory plus one, 0 marks an empty slot
+} dir_slot_t;
+
+// A block of the directory index held in memory while its slots are probed
+typedef struct dir_index_block_t {
+    uint32_t block;
+    dir_slot_t slots[BLOCK_SIZE / sizeof(dir_slot_t)];
+} dir_index_block_t;
+
+// The decoded data block numbers of a file, kept while the file is open
+typedef struct block_map_t {
+    uint32_t *blocks;
+    uint32_t count;    // Number of leading blocks of the file held in the map
+    uint32_t capacity;
+} block_map_t;
+
+// A block of the inode table held in memory, along with the state of its inodes while they are open
+typedef struct inode_page_t {
+    uint32_t block;
+    uint32_t pins;   // Number of open files, and the root directory, with their inode in this block
+    bool dirty;
+    bool referenced; // Set when the block is used, and cleared as the eviction clock passes it
+    inode_t inodes[INODES_PER_BLOCK];
+    uint32_t open_count[INODES_PER_BLOCK]; // Number of file descriptors open on each inode
+    bool unlinked[INODES_PER_BLOCK]; // Removed from the directory while open, so released when the last one closes
+    // Block maps of the open files and the root directory, so their pointer blocks are not read on every access
+    block_map_t block_maps[INODES_PER_BLOCK];
+} inode_page_t;
 
 super_block_t super_block;
-int free_block_map[FREE_BLOCK_MAP_ARR_SIZE];
-inode_t inode_table[NUM_OF_INODES];
-directory_entry_t root_dir[MAX_NUM_OF_DIR_ENTRIES];
-file_descriptor_entry_t file_desc_table[NUM_OF_INODES];
+// The tables below are sized by the geometry of the mounted disk, so they are allocated when it is mounted
+uint64_t *free_block_map;
+// Free bitmap blocks that changed since they were last written, and whether each block is in that list
+uint32_t *dirty_free_bitmap_blocks;
+uint32_t num_of_dirty_free_bitmap_blocks;
+bool *free_bitmap_block_dirty;
+// Data block where the next search for free blocks starts
+uint32_t next_fit_block;
+// The blocks of the inode table that are in memory, indexed by block and listed in the order the eviction clock visits
+inode_page_t **inode_pages;
+inode_page_t **resident_inode_pages;
+uint32_t num_of_resident_inode_pages;
+uint32_t resident_inode_pages_capacity;
+uint32_t inode_clock_hand;
+// The tables below grow with the number of open file descriptors
+file_descriptor_entry_t *file_desc_table;
+uint32_t file_desc_table_size;
+// Stack of unused file descriptor indices
+uint32_t *free_file_descs;
+uint32_t num_of_free_file_descs;
+// Bitmap of the inodes, where a set bit is a free inode, and the word where the search for a free inode starts
+uint64_t *free_inode_map;
+uint32_t next_free_inode_word; // Every word before this one has no free inode
+// Inode table blocks that changed since they were last written, with room for every block in memory
+uint32_t *dirty_inode_blocks;
+uint32_t num_of_dirty_inode_blocks;
 
 uint32_t current_file_index;
 
-bool allocate_data_blocks_for_inode(uint32_t final_size, inode_t *inode);
+// Locks, always taken in this order: directory, inode, file descriptors, allocator, inode table, journal, block cache.
+// Operations that change metadata are started with the journal before any of these locks are taken.
+// The directory lock guards the root directory, its index, its inode and the free inode map. An inode lock guards the data, block map
+// and open count of its inodes, and is held for writing while a file changes. Changes to the inode table itself,
+// and to its dirty tracking, are made under the inode table lock. Inode table blocks are also loaded and evicted
+// under it, except that blocks holding the inode of an open file are pinned, so that inode can be read without it.
+pthread_rwlock_t dir_lock = PTHREAD_RWLOCK_INITIALIZER;
+pthread_rwlock_t inode_locks[INODE_LOCK_STRIPES];
+pthread_once_t inode_locks_once = PTHREAD_ONCE_INIT;
+pthread_mutex_t file_desc_lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_mutex_t alloc_lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_mutex_t inode_table_lock = PTHREAD_MUTEX_INITIALIZER;
+
+bool allocate_data_blocks_for_inode(uint32_t final_size, uint32_t inode_num);
+
+bool reserve_block_map(block_map_t *map, uint32_t num_of_blocks);
+
+void release_block_map(uint32_t inode_num);
+
+void load_block_map(uint32_t inode_num);
+
+void release_file(uint32_t inode_num);
+
+void store_pointer_block(pointer_block_t *pointer_block);
+
+uint32_t read_file_data(uint32_t inode_num, uint32_t position, char *buf, uint32_t length);
+
+uint32_t write_file_data(uint32_t inode_num, uint32_t position, const char *buf, uint32_t length);
+
+/**
+ * Initialise the inode locks.
+ */
+void inode_locks_init() {
+    for (int i = 0; i < INODE_LOCK_STRIPES; ++i) {
+        pthread_rwlock_init(&inode_locks[i], NULL);
+    }
+}
+
+/**
+ * Get the lock guarding an inode.
+ * @param inode_num The number of the inode.
+ * @return A pointer to the lock.
+ */
+pthread_rwlock_t *inode_lock(uint32_t inode_num) {
+    pthread_once(&inode_locks_once, inode_locks_init);
+    return &inode_locks[inode_num % INODE_LOCK_STRIPES];
+}
 
 /**
- * Initialise the super block.
+ * Initialise the super block, laying out a disk of the given geometry.
+ * @param num_of_data_blocks The number of data blocks.
+ * @param num_of_inodes The number of inodes, including the one of the root directory.
+ * @return True if successful, false if the disk would be too large for the disk emulator to address.
  */
-void super_block_init() {
-    super_block.magic = 0xACBD0005;
+bool super_block_init(uint32_t num_of_data_blocks, uint32_t num_of_inodes) {
+    if (num_of_data_blocks == 0 || num_of_inodes < 2 || num_of_inodes > MAX_NUM_OF_INODES) {
+        return false;
+    }
+    // The directory index has a slot for every block it fills, and is kept at most half full
+    uint64_t num_of_dir_slots = DIR_SLOTS_PER_BLOCK;
+    while (num_of_dir_slots < 2 * (uint64_t) (num_of_inodes - 1)) {
+        num_of_dir_slots <<= 1;
+    }
+    const uint64_t num_of_dir_index_blocks = num_of_dir_slots / DIR_SLOTS_PER_BLOCK;
+    const uint64_t num_of_inode_blocks = CEIL((uint64_t) num_of_inodes * sizeof(inode_t), BLOCK_SIZE);
+    const uint64_t num_of_free_bitmap_blocks = CEIL(CEIL((uint64_t) num_of_data_blocks, 8), BLOCK_SIZE); // 8 bits in each byte
+    const uint64_t num_of_inode_bitmap_blocks = CEIL(CEIL((uint64_t) num_of_inodes, 8), BLOCK_SIZE);
+    const uint64_t total = JOURNAL_OFFSET + NUM_OF_JOURNAL_BLOCKS + num_of_inode_blocks + num_of_data_blocks
+                           + num_of_free_bitmap_blocks + num_of_inode_bitmap_blocks + num_of_dir_index_blocks;
+    if (total > INT_MAX) {
+        return false;
+    }
+
+    super_block.magic = SUPER_BLOCK_MAGIC;
     super_block.block_size = BLOCK_SIZE;
-    super_block.file_sys_size = TOTAL_NUM_OF_BLOCKS;
-    super_block.inode_table_length = NUM_OF_INODES;
+    super_block.file_sys_size = total;
+    super_block.inode_table_length = num_of_inode_blocks;
     super_block.root_dir = 0;
+    super_block.journal_start = JOURNAL_OFFSET;
+    super_block.journal_length = NUM_OF_JOURNAL_BLOCKS;
+    super_block.num_of_inodes = num_of_inodes;
+    super_block.num_of_data_blocks = num_of_data_blocks;
+    super_block.inode_table_start = JOURNAL_OFFSET + NUM_OF_JOURNAL_BLOCKS;
+    super_block.data_blocks_start = super_block.inode_table_start + num_of_inode_blocks;
+    super_block.free_bitmap_start = super_block.data_blocks_start + num_of_data_blocks;
+    super_block.free_bitmap_length = num_of_free_bitmap_blocks;
+    super_block.inode_bitmap_start = super_block.free_bitmap_start + num_of_free_bitmap_blocks;
+    super_block.inode_bitmap_length = num_of_inode_bitmap_blocks;
+    super_block.dir_index_start = super_block.inode_bitmap_start + num_of_inode_bitmap_blocks;
+    super_block.dir_index_length = num_of_dir_index_blocks;
+    return true;
+}
+
+/**
+ * Free the tables of the mounted disk.
+ */
+void release_tables() {
+    for (uint32_t i = 0; i < num_of_resident_inode_pages; ++i) {
+        for (uint32_t j = 0; j < INODES_PER_BLOCK; ++j) {
+            free(resident_inode_pages[i]->block_maps[j].blocks);
+        }
+        free(resident_inode_pages[i]);
+    }
+    free(free_block_map);
+    free(inode_pages);
+    free(resident_inode_pages);
+    free(file_desc_table);
+    free(free_file_descs);
+    free(free_inode_map);
+    free(dirty_inode_blocks);
+    free(dirty_free_bitmap_blocks);
+    free(free_bitmap_block_dirty);
+    free_block_map = NULL;
+    inode_pages = NULL;
+    resident_inode_pages = NULL;
+    num_of_resident_inode_pages = 0;
+    resident_inode_pages_capacity = 0;
+    inode_clock_hand = 0;
+    file_desc_table = NULL;
+    file_desc_table_size = 0;
+    free_file_descs = NULL;
+    num_of_free_file_descs = 0;
+    free_inode_map = NULL;
+    next_free_inode_word = 0;
+    dirty_inode_blocks = NULL;
+    num_of_dirty_inode_blocks = 0;
+    dirty_free_bitmap_blocks = NULL;
+    num_of_dirty_free_bitmap_blocks = 0;
+    free_bitmap_block_dirty = NULL;
+}
+
+/**
+ * Allocate the tables for the geometry in the super block.
+ * The other tables start out empty, and grow as they are used.
+ * @return True if successful, false if unsuccessful.
+ */
+bool allocate_tables() {
+    // The bitmaps are transferred as whole blocks, so they cover every one of their blocks
+    free_block_map = malloc((size_t) NUM_OF_FREE_BITMAP_BLOCKS * BLOCK_SIZE);
+    free_inode_map = malloc((size_t) NUM_OF_INODE_BITMAP_BLOCKS * BLOCK_SIZE);
+    dirty_free_bitmap_blocks = malloc(NUM_OF_FREE_BITMAP_BLOCKS * sizeof(uint32_t));
+    free_bitmap_block_dirty = calloc(NUM_OF_FREE_BITMAP_BLOCKS, sizeof(bool));
+    // Only the blocks of the inode table that are used are loaded, these start out empty
+    inode_pages = calloc(NUM_OF_INODE_BLOCKS, sizeof(inode_page_t *));
+    if (free_block_map == NULL || free_inode_map == NULL || dirty_free_bitmap_blocks == NULL
+        || free_bitmap_block_dirty == NULL || inode_pages == NULL) {
+        release_tables();
+        return false;
+    }
+    return true;
 }
 
 /**
- * Initialise the inode table.
+ * Initialise the inode table on the disk, a run of blocks at a time.
  */
 void inode_table_init() {
-    for (int i = 0; i < NUM_OF_INODES; ++i) {
-        inode_table[i].mode = 0;     // Not sure
-        inode_table[i].link_cnt = 0; // Not sure
-        inode_table[i].uid = 0;      // Not sure
-        inode_table[i].gid = 0;      // Not sure
-        inode_table[i].size = 0;
-        inode_table[i].indirect = NUM_OF_DATA_BLOCKS;  // Initialise an invalid number
+    inode_t inodes[INODE_INIT_BLOCKS * INODES_PER_BLOCK];
+    for (uint32_t i = 0; i < INODE_INIT_BLOCKS * INODES_PER_BLOCK; ++i) {
+        inodes[i].mode = 0;     // Not sure
+        inodes[i].link_cnt = 0; // Not sure
+        inodes[i].uid = 0;      // Not sure
+        inodes[i].gid = 0;      // Not sure
+        inodes[i].size = 0;
+        inodes[i].indirect = NUM_OF_DATA_BLOCKS;  // Initialise an invalid number
+        inodes[i].double_indirect = NUM_OF_DATA_BLOCKS;
+        inodes[i].triple_indirect = NUM_OF_DATA_BLOCKS;
+        memset(inodes[i].unused, 0, sizeof(inodes[i].unused));
         for (int j = 0; j < NUM_OF_DATA_PTRS; ++j) {
-            inode_table[i].data_ptrs[j] = NUM_OF_DATA_BLOCKS;  // Initialise an invalid number
+            inodes[i].data_ptrs[j] = NUM_OF_DATA_BLOCKS;  // Initialise an invalid number
+        }
+    }
+    for (uint32_t block = 0; block < NUM_OF_INODE_BLOCKS; block += INODE_INIT_BLOCKS) {
+        const uint32_t run = NUM_OF_INODE_BLOCKS - block < INODE_INIT_BLOCKS ? NUM_OF_INODE_BLOCKS - block : INODE_INIT_BLOCKS;
+        cache_write_blocks(INODE_BLOCKS_OFFSET + block, run, inodes);
+    }
+}
+
+/**
+ * Evict a block of the inode table from memory, with the inode table lock held.
+ * The blocks are visited in turn, and a block is only evicted once it was not used since the last visit.
+ * Blocks that are pinned or that changed since they were last written are kept.
+ */
+void evict_inode_page() {
+    for (uint32_t i = 0; i < 2 * num_of_resident_inode_pages; ++i) {
+        if (inode_clock_hand >= num_of_resident_inode_pages) {
+            inode_clock_hand = 0;
+        }
+        inode_page_t *const page = resident_inode_pages[inode_clock_hand];
+        if (page->pins > 0 || page->dirty || page->referenced) {
+            page->referenced = false;
+            inode_clock_hand++;
+            continue;
+        }
+        inode_pages[page->block] = NULL;
+        resident_inode_pages[inode_clock_hand] = resident_inode_pages[--num_of_resident_inode_pages];
+        free(page);
+        return;
+    }
+}
+
+/**
+ * Get a block of the inode table, loading it if it is not in memory, with the inode table lock held.
+ * Blocks are read through the journal, which holds the latest version of those that changed.
+ * @param block The block of the inode table.
+ * @return A pointer to the block, which stays valid while the lock is held or an inode in it is pinned.
+ * Returns NULL if there is no memory for the block.
+ */
+inode_page_t *load_inode_page(uint32_t block) {
+    inode_page_t *page = inode_pages[block];
+    if (page != NULL) {
+        page->referenced = true;
+        return page;
+    }
+
+    if (num_of_resident_inode_pages >= MAX_RESIDENT_INODE_PAGES) {
+        evict_inode_page();
+    }
+    if (num_of_resident_inode_pages == resident_inode_pages_capacity) {
+        const uint32_t capacity = resident_inode_pages_capacity > 0 ? resident_inode_pages_capacity * 2 : 64;
+        inode_page_t **const pages = realloc(resident_inode_pages, capacity * sizeof(inode_page_t *));
+        if (pages == NULL) {
+            return NULL;
+        }
+        resident_inode_pages = pages;
+        // Only blocks in memory can be dirty, so the dirty list never needs more room than the list of those blocks
+        uint32_t *const dirty = realloc(dirty_inode_blocks, capacity * sizeof(uint32_t));
+        if (dirty == NULL) {
+            return NULL;
+        }
+        dirty_inode_blocks = dirty;
+        resident_inode_pages_capacity = capacity;
+    }
+    page = malloc(sizeof(inode_page_t));
+    if (page == NULL) {
+        return NULL;
+    }
+    page->block = block;
+    page->pins = 0;
+    page->dirty = false;
+    page->referenced = true;
+    memset(page->open_count, 0, sizeof(page->open_count));
+    memset(page->unlinked, 0, sizeof(page->unlinked));
+    memset(page->block_maps, 0, sizeof(page->block_maps));
+    journal_read_blocks(INODE_BLOCKS_OFFSET + block, 1, page->inodes);
+    inode_pages[block] = page;
+    resident_inode_pages[num_of_resident_inode_pages++] = page;
+    return page;
+}
+
+/**
+ * Get an inode, loading its block of the inode table if needed, with the inode table lock held.
+ * @param inode_num The number of the inode.
+ * @return A pointer to the inode, which stays valid while the lock is held or the inode is pinned.
+ * Returns NULL if there is no memory for its block.
+ */
+inode_t *get_inode(uint32_t inode_num) {
+    inode_page_t *const page = load_inode_page(inode_num / INODES_PER_BLOCK);
+    return page != NULL ? &page->inodes[inode_num % INODES_PER_BLOCK] : NULL;
+}
+
+/**
+ * Keep the block holding an inode in memory until it is unpinned.
+ * @param inode_num The number of the inode.
+ * @return A pointer to the inode, or NULL if there is no memory for its block.
+ */
+inode_t *pin_inode(uint32_t inode_num) {
+    pthread_mutex_lock(&inode_table_lock);
+    inode_page_t *const page = load_inode_page(inode_num / INODES_PER_BLOCK);
+    if (page != NULL) {
+        page->pins++;
+    }
+    pthread_mutex_unlock(&inode_table_lock);
+    return page != NULL ? &page->inodes[inode_num % INODES_PER_BLOCK] : NULL;
+}
+
+/**
+ * Allow the block holding an inode to be evicted again.
+ * @param inode_num The number of the inode, which must be pinned.
+ */
+void unpin_inode(uint32_t inode_num) {
+    pthread_mutex_lock(&inode_table_lock);
+    inode_pages[inode_num / INODES_PER_BLOCK]->pins--;
+    pthread_mutex_unlock(&inode_table_lock);
+}
+
+/**
+ * Get a pinned inode, such as the inode of an open file or of the root directory, without taking any lock.
+ * @param inode_num The number of the inode.
+ * @return A pointer to the inode.
+ */
+inode_t *pinned_inode(uint32_t inode_num) {
+    return &inode_pages[inode_num / INODES_PER_BLOCK]->inodes[inode_num % INODES_PER_BLOCK];
+}
+
+/**
+ * Get the block map of a pinned inode.
+ * @param inode_num The number of the inode.
+ * @return A pointer to the block map.
+ */
+block_map_t *block_map_of(uint32_t inode_num) {
+    return &inode_pages[inode_num / INODES_PER_BLOCK]->block_maps[inode_num % INODES_PER_BLOCK];
+}
+
+/**
+ * Get the number of file descriptors open on a pinned inode.
+ * @param inode_num The number of the inode.
+ * @return A pointer to the count.
+ */
+uint32_t *open_count_of(uint32_t inode_num) {
+    return &inode_pages[inode_num / INODES_PER_BLOCK]->open_count[inode_num % INODES_PER_BLOCK];
+}
+
+/**
+ * Get whether a pinned inode was removed from the directory while it was open.
+ * @param inode_num The number of the inode.
+ * @return A pointer to the flag.
+ */
+bool *unlinked_of(uint32_t inode_num) {
+    return &inode_pages[inode_num / INODES_PER_BLOCK]->unlinked[inode_num % INODES_PER_BLOCK];
+}
+
+/**
+ * Get the position of an entry within the data of the root directory.
+ * The size of the root directory is the position of the entry past its last one.
+ * @param idx The index of the entry.
+ * @return The position of the entry in bytes.
+ */
+uint32_t dir_entry_position(uint32_t idx) {
+    return idx / DIR_ENTRIES_PER_BLOCK * BLOCK_SIZE + idx % DIR_ENTRIES_PER_BLOCK * sizeof(directory_entry_t);
+}
+
+/**
+ * Get the number of entries in the root directory.
+ * @return The number of entries, which are contiguous from the start of the root directory.
+ */
+uint32_t num_of_dir_entries() {
+    const uint32_t size = pinned_inode(super_block.root_dir)->size;
+    return size / BLOCK_SIZE * DIR_ENTRIES_PER_BLOCK + size % BLOCK_SIZE / sizeof(directory_entry_t);
+}
+
+/**
+ * Hash a file name using FNV-1a.
+ * @param file_name The file name to hash, at most MAX_FILE_NAME_SIZE characters are considered.
+ * @return The hash of the file name.
+ */
+uint32_t hash_file_name(const char *const file_name) {
+    uint32_t hash = 2166136261u;
+    for (int i = 0; i < MAX_FILE_NAME_SIZE && file_name[i] != '\0'; ++i) {
+        hash ^= (uint8_t) file_name[i];
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+/**
+ * Read an entry of the root directory.
+ * @param idx The index of the entry.
+ * @param entry A pointer to be populated with the entry.
+ */
+void read_dir_entry(uint32_t idx, directory_entry_t *const entry) {
+    read_file_data(super_block.root_dir, dir_entry_position(idx), (char *) entry, sizeof(directory_entry_t));
+}
+
+/**
+ * Write an entry of the root directory to the disk, which only changes the block holding it.
+ * @param idx The index of the entry, whose data block must already be allocated.
+ * @param entry The entry to write.
+ */
+void write_dir_entry(uint32_t idx, const directory_entry_t *const entry) {
+    write_file_data(super_block.root_dir, dir_entry_position(idx), (const char *) entry, sizeof(directory_entry_t));
+}
+
+/**
+ * Read a slot of the directory index, reading its block unless the buffer already holds it.
+ * @param buf The buffer holding the last block of the directory index that was read.
+ * @param slot The slot to read.
+ * @return The slot.
+ */
+dir_slot_t read_dir_slot(dir_index_block_t *const buf, uint32_t slot) {
+    const uint32_t block = slot / DIR_SLOTS_PER_BLOCK;
+    if (buf->block != block) {
+        journal_read_blocks(DIR_INDEX_OFFSET + block, 1, buf->slots);
+        buf->block = block;
+    }
+    return buf->slots[slot % DIR_SLOTS_PER_BLOCK];
+}
+
+/**
+ * Change a slot of the directory index and write its block to the disk.
+ * @param buf The buffer holding the last block of the directory index that was read.
+ * @param slot The slot to change.
+ * @param value The new value of the slot.
+ */
+void write_dir_slot(dir_index_block_t *const buf, uint32_t slot, dir_slot_t value) {
+    read_dir_slot(buf, slot);
+    buf->slots[slot % DIR_SLOTS_PER_BLOCK] = value;
+    journal_write_blocks(DIR_INDEX_OFFSET + buf->block, 1, buf->slots);
+}
+
+/**
+ * Find the slot of the directory index that holds the given file name.
+ * Only the entries whose slot holds the same hash are read to compare their names.
+ * @param buf The buffer to read the blocks of the directory index into.
+ * @param file_name The file name to look for.
+ * @param entry A pointer to be populated with the entry of the file name if it is indexed.
+ * @return The slot holding the file name if it is indexed, otherwise the empty slot ending its probe sequence.
+ */
+uint32_t dir_index_slot(dir_index_block_t *const buf, const char *const file_name, directory_entry_t *const entry) {
+    const uint32_t hash = hash_file_name(file_name);
+    uint32_t slot = hash & (NUM_OF_DIR_SLOTS - 1);
+    while (true) {
+        const dir_slot_t value = read_dir_slot(buf, slot);
+        if (value.entry == 0) {
+            return slot;
+        }
+        if (value.hash == hash) {
+            read_dir_entry(value.entry - 1, entry);
+            if (strncmp(entry->file_name, file_name, MAX_FILE_NAME_SIZE) == 0) {
+                return slot;
+            }
         }
+        slot = (slot + 1) & (NUM_OF_DIR_SLOTS - 1);
+    }
+}
+
+/**
+ * Look up a file name in the directory index.
+ * @param file_name The file name to look up.
+ * @param entry A pointer to be populated with the entry of the file if it exists.
+ * @return The root directory index of the file if it exists, DIR_INDEX_EMPTY otherwise.
+ */
+uint32_t dir_index_find(const char *const file_name, directory_entry_t *const entry) {
+    // Names are only compared up to the length they are stored with, so a longer name must not match its prefix
+    if (strlen(file_name) > MAX_FILE_NAME_SIZE) {
+        return DIR_INDEX_EMPTY;
+    }
+    dir_index_block_t buf;
+    buf.block = NUM_OF_DIR_INDEX_BLOCKS;
+    const dir_slot_t value = read_dir_slot(&buf, dir_index_slot(&buf, file_name, entry));
+    return value.entry != 0 ? value.entry - 1 : DIR_INDEX_EMPTY;
+}
+
+/**
+ * Add a file name that is not in the directory index to it.
+ * @param file_name The file name to add.
+ * @param idx The root directory index of its entry.
+ */
+void dir_index_insert(const char *const file_name, uint32_t idx) {
+    dir_index_block_t buf;
+    buf.block = NUM_OF_DIR_INDEX_BLOCKS;
+    const uint32_t hash = hash_file_name(file_name);
+    uint32_t slot = hash & (NUM_OF_DIR_SLOTS - 1);
+    while (read_dir_slot(&buf, slot).entry != 0) {
+        slot = (slot + 1) & (NUM_OF_DIR_SLOTS - 1);
+    }
+    const dir_slot_t value = {hash, idx + 1};
+    write_dir_slot(&buf, slot, value);
+}
+
+/**
+ * Point the directory index at the new position of a root directory entry.
+ * @param file_name The file name of the entry that moved.
+ * @param from The old root directory index of the entry.
+ * @param to The new root directory index of the entry.
+ */
+void dir_index_move(const char *const file_name, uint32_t from, uint32_t to) {
+    dir_index_block_t buf;
+    buf.block = NUM_OF_DIR_INDEX_BLOCKS;
+    const uint32_t hash = hash_file_name(file_name);
+    uint32_t slot = hash & (NUM_OF_DIR_SLOTS - 1);
+    while (read_dir_slot(&buf, slot).entry != from + 1) {
+        slot = (slot + 1) & (NUM_OF_DIR_SLOTS - 1);
     }
+    const dir_slot_t value = {hash, to + 1};
+    write_dir_slot(&buf, slot, value);
 }
 
 /**
- * Initialise the root directory.
+ * Remove a file name from the directory index.
+ * The freed slot is filled by shifting later members of the probe sequence back, so no tombstones are needed.
+ * @param file_name The file name to remove.
  */
-void root_dir_init() {
-    for (int i = 0; i < MAX_NUM_OF_DIR_ENTRIES; ++i) {
-        root_dir[i].inode_num = 0;  // Initialise an invalid number
+void dir_index_remove(const char *const file_name) {
+    dir_index_block_t buf;
+    buf.block = NUM_OF_DIR_INDEX_BLOCKS;
+    directory_entry_t entry;
+    uint32_t hole = dir_index_slot(&buf, file_name, &entry);
+    if (read_dir_slot(&buf, hole).entry == 0) {
+        return;
     }
+    uint32_t slot = hole;
+    while (true) {
+        slot = (slot + 1) & (NUM_OF_DIR_SLOTS - 1);
+        const dir_slot_t value = read_dir_slot(&buf, slot);
+        if (value.entry == 0) {
+            break;
+        }
+        const uint32_t home = value.hash & (NUM_OF_DIR_SLOTS - 1);
+        // Only move the slot back if the hole lies between its home slot and its current slot
+        if (((slot - home) & (NUM_OF_DIR_SLOTS - 1)) >= ((slot - hole) & (NUM_OF_DIR_SLOTS - 1))) {
+            write_dir_slot(&buf, hole, value);
+            hole = slot;
+        }
+    }
+    const dir_slot_t empty = {0, 0};
+    write_dir_slot(&buf, hole, empty);
 }
 
 /**
  * Initialise the free block map.
  */
 void free_block_map_init() {
-    const int free = ~((int) 0);  // Set all bits to 1
-    for (int i = 0; i < FREE_BLOCK_MAP_ARR_SIZE; ++i) {
+    const uint64_t free = ~((uint64_t) 0);  // Set all bits to 1
+    for (uint32_t i = 0; i < FREE_BLOCK_MAP_ARR_SIZE; ++i) {
         free_block_map[i] = free;
     }
 }
 
 /**
- * Initialise the file descriptor table.
+ * Initialise the free inode map, where only the inode of the root directory is in use.
  */
-void file_desc_table_init() {
-    for (int i = 0; i < NUM_OF_INODES; ++i) {
-        file_desc_table[i].inode_num = NUM_OF_INODES; // Initialise an invalid number
-        file_desc_table[i].read_write_ptr = 0;
+void free_inode_map_init() {
+    const uint64_t free = ~((uint64_t) 0);  // Set all bits to 1
+    for (uint32_t i = 0; i < FREE_INODE_MAP_ARR_SIZE; ++i) {
+        free_inode_map[i] = free;
     }
+    free_inode_map[super_block.root_dir / BITS_PER_MAP_WORD] &= ~(((uint64_t) 1) << (super_block.root_dir % BITS_PER_MAP_WORD));
 }
 
 /**
- * Reads the information collected from the inode metadata into the given pointer.
- * @param inode The inode to read from.
- * @param ptr The pointer to read into.
+ * Make room for more file descriptors once every one is in use, with the file descriptor lock held.
+ * @return True if successful, false if there can be no more file descriptors or there is no memory for them.
  */
-void read_into_ptr(const inode_t inode, const void *ptr) {
-    const int blocks_used = CEIL(inode.size, BLOCK_SIZE);
-    for (int i = 0; i < NUM_OF_DATA_PTRS && i < blocks_used; ++i) {
-        // Read each data block one by one into the pointer
-        read_blocks(DATA_BLOCKS_OFFSET + inode.data_ptrs[i], 1,
-                    ((uint8_t *) ptr) + (i * BLOCK_SIZE)); // Use uint8_t instead of void for pointer arithmetic
+bool grow_file_desc_table() {
+    if (file_desc_table_size >= NUM_OF_INODES) {
+        return false;
     }
-    if (blocks_used > NUM_OF_DATA_PTRS) {
-        const uint32_t num_of_ptrs = blocks_used - NUM_OF_DATA_PTRS;
-        uint32_t ptrs[INDIRECT_LIST_SIZE];
-        // Getting the indirect pointers
-        read_blocks(DATA_BLOCKS_OFFSET + inode.indirect, 1, ptrs);
-        // Read each data block one by one into the pointer
-        for (int i = 0; i < num_of_ptrs; ++i) {
-            read_blocks(DATA_BLOCKS_OFFSET + ptrs[i], 1,
-                        ((uint8_t *) ptr) + ((i + NUM_OF_DATA_PTRS) * BLOCK_SIZE));
-        }
+    uint32_t size = file_desc_table_size > 0 ? file_desc_table_size * 2 : MIN_FILE_DESC_TABLE_SIZE;
+    size = size < NUM_OF_INODES ? size : NUM_OF_INODES;
+    file_descriptor_entry_t *const table = realloc(file_desc_table, size * sizeof(file_descriptor_entry_t));
+    if (table == NULL) {
+        return false;
+    }
+    file_desc_table = table;
+    uint32_t *const descs = realloc(free_file_descs, size * sizeof(uint32_t));
+    if (descs == NULL) {
+        return false;
     }
+    free_file_descs = descs;
+    for (uint32_t i = size; i > file_desc_table_size; --i) {
+        file_desc_table[i - 1].inode_num = NUM_OF_INODES; // Initialise an invalid number
+        file_desc_table[i - 1].read_write_ptr = 0;
+        // Pushed in reverse, so that the lowest indices are handed out first
+        free_file_descs[num_of_free_file_descs++] = i - 1;
+    }
+    file_desc_table_size = size;
+    return true;
 }
 
 /**
- * Writes the information in the given pointer into the blocks that the inode points to.
- * @param inode The inode to write into.
- * @param ptr The pointer to write from.
+ * Mark the inode table block holding the given inode as changed, with the block in memory.
+ * @param inode_num The number of the inode that changed.
  */
-void write_from_ptr(const inode_t inode, const void *ptr) {
-    const int blocks_used = CEIL(inode.size, BLOCK_SIZE);
-    for (int i = 0; i < NUM_OF_DATA_PTRS && i < blocks_used; ++i) {
-        // Read each data block one by one into the pointer
-        write_blocks(DATA_BLOCKS_OFFSET + inode.data_ptrs[i], 1,
-                     ((uint8_t *) ptr) + (i * BLOCK_SIZE)); // Use uint8_t instead of void for pointer arithmetic
+void mark_inode_dirty(uint32_t inode_num) {
+    const uint32_t block = inode_num / INODES_PER_BLOCK;
+    if (!inode_pages[block]->dirty) {
+        inode_pages[block]->dirty = true;
+        dirty_inode_blocks[num_of_dirty_inode_blocks++] = block;
     }
-    if (blocks_used > NUM_OF_DATA_PTRS) {
-        const uint32_t num_of_ptrs = blocks_used - NUM_OF_DATA_PTRS;
-        uint32_t ptrs[INDIRECT_LIST_SIZE];
-        // Getting the indirect pointers
-        write_blocks(DATA_BLOCKS_OFFSET + inode.indirect, 1, ptrs);
-        // Read each data block one by one into the pointer
-        for (int i = 0; i < num_of_ptrs; ++i) {
-            write_blocks(DATA_BLOCKS_OFFSET + ptrs[i], 1,
-                         ((uint8_t *) ptr) + ((i + NUM_OF_DATA_PTRS) * BLOCK_SIZE));
-        }
+}
+
+/**
+ * Write the inode table blocks that changed since the last flush to the disk.
+ */
+void flush_inode_table() {
+    for (uint32_t i = 0; i < num_of_dirty_inode_blocks; ++i) {
+        inode_page_t *const page = inode_pages[dirty_inode_blocks[i]];
+        journal_write_blocks(INODE_BLOCKS_OFFSET + page->block, 1, page->inodes);
+        page->dirty = false;
     }
+    num_of_dirty_inode_blocks = 0;
 }
 
 /**
- * Algorithm to make sure that all elements in the root directory are contiguous.
- * @param left The starting index to scan from.
+ * Write back everything cached for the mounted disk and close it.
+ * @return 0 if successful, -1 otherwise.
  */
-void move_invalid_entries_to_back(uint32_t left) {
-    uint32_t right = MAX_NUM_OF_DIR_ENTRIES - 1;
-    while (left < right) {
-        while (left < right && root_dir[right].inode_num == 0) {
-            right--;
-        }
-        if (root_dir[left].inode_num == 0) {
-            // swap the two elements
-            const directory_entry_t temp = root_dir[left];
-            root_dir[left] = root_dir[right];
-            root_dir[right] = temp;
+int sfs_unmount() {
+    // Closing the open files releases those that were removed while open, instead of leaving them on the disk
+    for (uint32_t i = 0; i < file_desc_table_size; ++i) {
+        if (file_desc_table[i].inode_num < NUM_OF_INODES) {
+            sfs_fclose((int) i);
         }
-        left++;
     }
+    int result = journal_close();
+    if (block_cache_flush() == -1) {
+        result = -1;
+    }
+    block_cache_invalidate();
+    if (sync_disk() == -1) {
+        result = -1;
+    }
+    close_disk();
+    release_tables();
+    return result;
 }
 
-void mksfs(int fresh) {
+/**
+ * Forget a disk that could not be created or mounted.
+ */
+void discard_disk() {
+    block_cache_invalidate();
+    close_disk();
+    release_tables();
+    memset(&super_block, 0, sizeof(super_block_t));
+}
+
+/**
+ * Create or mount the file system on a given disk. This must not run at the same time as any other call.
+ * @param fresh True to create a new file system, false to mount the existing one.
+ * @param disk_name The path of the disk file.
+ * @param num_of_data_blocks The number of data blocks of a new file system, the one on the disk is used when mounting.
+ * @param num_of_inodes The number of inodes of a new file system, the one on the disk is used when mounting.
+ * @return 0 if successful, -1 otherwise.
+ */
+int mksfs_geometry(int fresh, const char *disk_name, uint32_t num_of_data_blocks, uint32_t num_of_inodes) {
+    // Make sure nothing cached for a previously mounted disk ends up on this one
+    sfs_unmount();
     current_file_index = 0;
-    file_desc_table_init();
+    next_fit_block = 0;
+    num_of_dirty_inode_blocks = 0;
+    // The super block is smaller than a block, so it is transferred through a block sized buffer
+    uint8_t super_block_buf[BLOCK_SIZE] = {0};
 
     if (fresh) {
-        init_fresh_disk(DISK_NAME, BLOCK_SIZE, TOTAL_NUM_OF_BLOCKS);
+        if (!super_block_init(num_of_data_blocks, num_of_inodes) || !allocate_tables()
+            || init_fresh_disk_flags((char *) disk_name, BLOCK_SIZE, TOTAL_NUM_OF_BLOCKS, SFS_DISK_FLAGS) == -1) {
+            discard_disk();
+            return -1;
+        }
 
-        super_block_init();
         // Write the super block to the disk
-        write_blocks(0, INODE_BLOCKS_OFFSET, &super_block);
+        memcpy(super_block_buf, &super_block, sizeof(super_block_t));
+        cache_write_blocks(0, 1, super_block_buf);
 
-        inode_table_init();
         // Write the inode table to the disk
-        write_blocks(INODE_BLOCKS_OFFSET, NUM_OF_INODE_BLOCKS, inode_table);
+        inode_table_init();
+        // The root directory is in use for as long as the disk is mounted
+        // Its index needs no writing, as a fresh disk reads as zeros, which are empty slots
+        if (pin_inode(super_block.root_dir) == NULL) {
+            discard_disk();
+            return -1;
+        }
 
-        root_dir_init();
-        write_from_ptr(inode_table[super_block.root_dir], root_dir);
+        load_block_map(super_block.root_dir);
 
         free_block_map_init();
         // Write the free block map to the disk
-        write_blocks(FREE_BITMAP_OFFSET, NUM_OF_FREE_BITMAP_BLOCKS, free_block_map);
+        cache_write_blocks(FREE_BITMAP_OFFSET, NUM_OF_FREE_BITMAP_BLOCKS, free_block_map);
+        free_inode_map_init();
+        // Write the free inode map to the disk
+        cache_write_blocks(INODE_BITMAP_OFFSET, NUM_OF_INODE_BITMAP_BLOCKS, free_inode_map);
+        if (journal_open(super_block.journal_start, super_block.journal_length, true) == -1) {
+            discard_disk();
+            return -1;
+        }
     } else {
-        init_disk(DISK_NAME, BLOCK_SIZE, TOTAL_NUM_OF_BLOCKS);
+        // The size of the disk is only known once its super block is read
+        if (init_disk_flags((char *) disk_name, BLOCK_SIZE, 1, SFS_DISK_FLAGS) == -1) {
+            discard_disk();
+            return -1;
+        }
         // Read super block into memory
-        read_blocks(0, INODE_BLOCKS_OFFSET, &super_block);
-        // Read inode table into memory
-        read_blocks(INODE_BLOCKS_OFFSET, NUM_OF_INODE_BLOCKS, inode_table);
-        // Read root directory into memory
-        read_into_ptr(inode_table[super_block.root_dir], root_dir);
+        cache_read_blocks(0, 1, super_block_buf);
+        super_block_t on_disk;
+        memcpy(&on_disk, super_block_buf, sizeof(super_block_t));
+        close_disk();
+        // The layout is worked out again from the geometry, so a disk of another format or a damaged super block
+        // is turned away before anything is read from where it says the tables are
+        if (on_disk.magic != SUPER_BLOCK_MAGIC || on_disk.block_size != BLOCK_SIZE
+            || !super_block_init(on_disk.num_of_data_blocks, on_disk.num_of_inodes)
+            || memcmp(&super_block, &on_disk, sizeof(super_block_t)) != 0
+            || init_disk_flags((char *) disk_name, BLOCK_SIZE, TOTAL_NUM_OF_BLOCKS, SFS_DISK_FLAGS) == -1
+            || !allocate_tables()) {
+            discard_disk();
+            return -1;
+        }
+        // Changes committed before the disk was last closed are written to their home blocks before anything is read
+        // Without the journal, metadata would be written in place, so the disk is not mounted if it cannot be replayed
+        if (journal_open(super_block.journal_start, super_block.journal_length, false) == -1) {
+            discard_disk();
+            return -1;
+        }
+        // The inode table is read as it is used, only the inode of the root directory is needed up front
+        if (pin_inode(super_block.root_dir) == NULL) {
+            sfs_unmount();
+            return -1;
+        }
+        // The entries of the root directory and its index are read as they are looked up
+        load_block_map(super_block.root_dir);
         // Read free block map into memory
-        read_blocks(FREE_BITMAP_OFFSET, NUM_OF_FREE_BITMAP_BLOCKS, free_block_map);
+        cache_read_blocks(FREE_BITMAP_OFFSET, NUM_OF_FREE_BITMAP_BLOCKS, free_block_map);
+        // Read free inode map into memory, so the inodes in use are known without reading the directory
+        cache_read_blocks(INODE_BITMAP_OFFSET, NUM_OF_INODE_BITMAP_BLOCKS, free_inode_map);
+    }
+    return 0;
+}
+
+/**
+ * Create or mount the file system on the default disk, with the default geometry.
+ * This must not run at the same time as any other call.
+ * @param fresh True to create a new file system, false to mount the existing one.
+ */
+void mksfs(int fresh) {
+    mksfs_geometry(fresh, DISK_NAME, DEFAULT_NUM_OF_DATA_BLOCKS, DEFAULT_NUM_OF_INODES);
+}
+
+/**
+ * Read the records of the entries of the root directory from a cursor on, with the directory lock held.
+ * The entries are read a block at a time, and the inodes for their sizes under a single lock of the inode table.
+ * @param cursor The index of the first entry to read, moved past the entries read.
+ * @param records The buffer to fill with the records.
+ * @param count The number of records the buffer can hold.
+ * @return The number of records read, 0 at the end of the directory, -1 if an inode could not be read.
+ */
+int read_dir_records(uint32_t *const cursor, directory_record_t *const records, uint32_t count) {
+    directory_entry_t entries[DIR_ENTRIES_PER_BLOCK];
+    const uint32_t num_of_entries = num_of_dir_entries();
+    uint32_t result = 0;
+    while (result < count && *cursor + result < num_of_entries) {
+        const uint32_t idx = *cursor + result;
+        // Read the entries up to the end of the block holding the first one
+        uint32_t run = DIR_ENTRIES_PER_BLOCK - idx % DIR_ENTRIES_PER_BLOCK;
+        if (run > count - result) {
+            run = count - result;
+        }
+        if (run > num_of_entries - idx) {
+            run = num_of_entries - idx;
+        }
+        read_file_data(super_block.root_dir, dir_entry_position(idx), (char *) entries,
+                       run * sizeof(directory_entry_t));
+        for (uint32_t i = 0; i < run; ++i) {
+            memcpy(records[result + i].file_name, entries[i].file_name, MAX_FILE_NAME_SIZE);
+            records[result + i].file_name[MAX_FILE_NAME_SIZE] = '\0';
+            records[result + i].inode_num = entries[i].inode_num;
+        }
+        result += run;
+    }
+
+    // The sizes are read without locking the inodes, they may be changing under writers
+    pthread_mutex_lock(&inode_table_lock);
+    for (uint32_t i = 0; i < result; ++i) {
+        const inode_t *const inode = get_inode(records[i].inode_num);
+        if (inode == NULL) {
+            pthread_mutex_unlock(&inode_table_lock);
+            return -1;
+        }
+        records[i].size = __atomic_load_n(&inode->size, __ATOMIC_ACQUIRE);
     }
+    pthread_mutex_unlock(&inode_table_lock);
+
+    *cursor += result;
+    return (int) result;
 }
 
 /**
@@ -201,31 +904,59 @@ void mksfs(int fresh) {
  * @return 1 if successful, 0 otherwise.
  */
 int sfs_getnextfilename(char *file_name) {
-    if (current_file_index >= MAX_NUM_OF_DIR_ENTRIES || root_dir[current_file_index].inode_num == 0) {
+    directory_record_t record;
+    // The position in the directory is shared, so moving it takes the directory lock for writing
+    pthread_rwlock_wrlock(&dir_lock);
+    if (read_dir_records(&current_file_index, &record, 1) <= 0) {
         current_file_index = 0;
+        pthread_rwlock_unlock(&dir_lock);
         return 0;
     }
+    pthread_rwlock_unlock(&dir_lock);
 
-    strncpy(file_name, root_dir[current_file_index].file_name, MAX_FILE_NAME_SIZE);
-    current_file_index++;
-
+    strncpy(file_name, record.file_name, MAX_FILE_NAME_SIZE);
     return 1;
 }
 
+/**
+ * Read the name, inode number and size of many files of the root directory in a single call.
+ * Each caller keeps its own cursor, so listings running at the same time do not disturb each other.
+ * A file removed during a listing moves the last entry into its place, which the listing misses if it is past it.
+ * @param cursor The position in the directory, which must start at 0 and is moved past the records read.
+ * @param records The buffer to fill with the records.
+ * @param count The number of records the buffer can hold.
+ * @return The number of records read, 0 at the end of the directory, -1 if unsuccessful.
+ */
+int sfs_readdirplus(uint32_t *cursor, directory_record_t *records, int count) {
+    if (count <= 0) {
+        return 0;
+    }
+    pthread_rwlock_rdlock(&dir_lock);
+    const int result = read_dir_records(cursor, records, count);
+    pthread_rwlock_unlock(&dir_lock);
+    return result;
+}
+
 /**
  * Get the file size of a given file.
  * @param file_name The file to get the size of.
  * @return The file size in bytes of the given file if the given file exists. Otherwise it returns -1.
  */
 int sfs_getfilesize(const char *file_name) {
-    for (int i = 0; i < MAX_NUM_OF_DIR_ENTRIES; ++i) {
-        const directory_entry_t dir_entry = root_dir[i];
-        if (dir_entry.inode_num != 0 && strcmp(file_name, dir_entry.file_name) == 0) {
-            return (int) inode_table[dir_entry.inode_num].size;
-        }
+    pthread_rwlock_rdlock(&dir_lock);
+    directory_entry_t entry;
+    if (dir_index_find(file_name, &entry) == DIR_INDEX_EMPTY) {
+        pthread_rwlock_unlock(&dir_lock);
+        return -1;
     }
 
-    return -1;
+    // The size is read without locking the inode, it may be changing under a writer
+    pthread_mutex_lock(&inode_table_lock);
+    const inode_t *const inode = get_inode(entry.inode_num);
+    const int result = inode != NULL ? (int) __atomic_load_n(&inode->size, __ATOMIC_ACQUIRE) : -1;
+    pthread_mutex_unlock(&inode_table_lock);
+    pthread_rwlock_unlock(&dir_lock);
+    return result;
 }
 
 /**
@@ -237,16 +968,16 @@ int sfs_getfilesize(const char *file_name) {
  * If the file does not exist and the directory is full populate idx with MAX_NUM_OF_DIR_ENTRIES to signal failure.
  */
 uint32_t find_inode_num(const char *const file_name, uint32_t *const idx) {
-    uint32_t i;
-    for (i = 0; i < MAX_NUM_OF_DIR_ENTRIES && root_dir[i].inode_num != 0; ++i) {
-        const directory_entry_t dir_entry = root_dir[i];
-        if (strcmp(dir_entry.file_name, file_name) == 0) {
-            *idx = i;
-            return dir_entry.inode_num;
-        }
+    directory_entry_t entry;
+    const uint32_t found = dir_index_find(file_name, &entry);
+    if (found != DIR_INDEX_EMPTY) {
+        *idx = found;
+        return entry.inode_num;
     }
 
-    *idx = i < MAX_NUM_OF_DIR_ENTRIES ? i : MAX_NUM_OF_DIR_ENTRIES;
+    // Entries in the root directory are contiguous, so the next free index is the number of entries
+    const uint32_t num_of_entries = num_of_dir_entries();
+    *idx = num_of_entries < MAX_NUM_OF_DIR_ENTRIES ? num_of_entries : MAX_NUM_OF_DIR_ENTRIES;
     return MAX_NUM_OF_DIR_ENTRIES;
 }
 
@@ -257,101 +988,250 @@ uint32_t find_inode_num(const char *const file_name, uint32_t *const idx) {
  * @return The index of the new file descriptor entry if successful. -1 if unsuccessful.
  */
 int get_next_file_desc_idx(uint32_t inode_num, uint32_t read_write_ptr) {
-    int i;
-    for (i = 0; i < NUM_OF_INODES; ++i) {
-        if (file_desc_table[i].inode_num >= NUM_OF_INODES) {
-            file_desc_table[i].inode_num = inode_num;
-            file_desc_table[i].read_write_ptr = read_write_ptr;
-            return i;
-        }
+    pthread_mutex_lock(&file_desc_lock);
+    if (num_of_free_file_descs == 0 && !grow_file_desc_table()) {
+        pthread_mutex_unlock(&file_desc_lock);
+        return -1;
     }
 
-    return -1;
+    const uint32_t i = free_file_descs[--num_of_free_file_descs];
+    file_desc_table[i].inode_num = inode_num;
+    file_desc_table[i].read_write_ptr = read_write_ptr;
+    (*open_count_of(inode_num))++;
+    pthread_mutex_unlock(&file_desc_lock);
+    return (int) i;
 }
 
 /**
- * Get the lowest inode number that isn't being used.
- * This function uses quite a lot of memory, since I did not feel like implementing a hashset.
- * @return The lowest inode number that isn't being used if successful.
- * Returns MAX_NUM_OF_DIR_ENTRIES if unsuccessful.
+ * Get a copy of a file descriptor entry.
+ * @param fileID The index of the file descriptor.
+ * @param fde A pointer to be populated with the entry.
+ * @return True if the file descriptor is open, false otherwise.
  */
-uint32_t get_lowest_inode_num() {
-    bool is_taken[MAX_NUM_OF_DIR_ENTRIES + 1];
-    uint32_t i;
-    for (i = 1; i < MAX_NUM_OF_DIR_ENTRIES; ++i) {
-        is_taken[i] = false;
+bool get_file_desc(int fileID, file_descriptor_entry_t *const fde) {
+    if (0 > fileID) {
+        return false;
     }
-
-    for (i = 0; i < MAX_NUM_OF_DIR_ENTRIES && root_dir[i].inode_num != 0; ++i) {
-        is_taken[root_dir[i].inode_num] = true;
-    }
-
-    for (i = 1; i < MAX_NUM_OF_DIR_ENTRIES; ++i) {
-        if (!is_taken[i]) {
-            return i;
-        }
+    pthread_mutex_lock(&file_desc_lock);
+    const bool is_valid = (uint32_t) fileID < file_desc_table_size && file_desc_table[fileID].inode_num < NUM_OF_INODES;
+    if (is_valid) {
+        *fde = file_desc_table[fileID];
     }
+    pthread_mutex_unlock(&file_desc_lock);
+    return is_valid;
+}
 
-    return MAX_NUM_OF_DIR_ENTRIES;
+/**
+ * Write the block of the free inode map holding a word to the disk.
+ * @param word The index of the word that changed.
+ */
+void write_free_inode_map(uint32_t word) {
+    const uint32_t block = word * sizeof(uint64_t) / BLOCK_SIZE;
+    journal_write_blocks(INODE_BITMAP_OFFSET + block, 1, ((uint8_t *) free_inode_map) + ((size_t) block * BLOCK_SIZE));
 }
 
-bool is_open(const char *const name) {
-    for (int i = 0; i < NUM_OF_INODES; ++i) {
-        if (file_desc_table[i].inode_num < NUM_OF_INODES) {
-            for (int j = 0; j < MAX_NUM_OF_DIR_ENTRIES && root_dir[j].inode_num != 0; ++j) {
-                if (file_desc_table[i].inode_num == root_dir[j].inode_num
-                    && strcmp(root_dir[j].file_name, name) == 0) {
-                    return true;
-                }
-            }
-        }
+/**
+ * Take the lowest inode number that isn't being used, with the directory lock held for writing.
+ * The free inode map is searched a word at a time, starting at the first word that can hold a free inode.
+ * @return The inode number taken if successful.
+ * Returns MAX_NUM_OF_DIR_ENTRIES if unsuccessful.
+ */
+uint32_t take_inode_num() {
+    while (next_free_inode_word < FREE_INODE_MAP_ARR_SIZE && free_inode_map[next_free_inode_word] == 0) {
+        next_free_inode_word++;
+    }
+    if (next_free_inode_word == FREE_INODE_MAP_ARR_SIZE) {
+        return MAX_NUM_OF_DIR_ENTRIES;
     }
+    const uint32_t bit_idx = __builtin_ctzll(free_inode_map[next_free_inode_word]);
+    const uint32_t inode_num = next_free_inode_word * BITS_PER_MAP_WORD + bit_idx;
+    if (inode_num >= MAX_NUM_OF_DIR_ENTRIES) {
+        return MAX_NUM_OF_DIR_ENTRIES;
+    }
+    free_inode_map[next_free_inode_word] &= ~(((uint64_t) 1) << bit_idx);
+    write_free_inode_map(next_free_inode_word);
+    return inode_num;
+}
 
-    return false;
+/**
+ * Give back an inode number, with the directory lock held for writing.
+ * @param inode_num The inode number, which must have been taken.
+ */
+void release_inode_num(uint32_t inode_num) {
+    const uint32_t word = inode_num / BITS_PER_MAP_WORD;
+    free_inode_map[word] |= ((uint64_t) 1) << (inode_num % BITS_PER_MAP_WORD);
+    next_free_inode_word = word < next_free_inode_word ? word : next_free_inode_word;
+    write_free_inode_map(word);
 }
 
-int sfs_fopen(char *file_name) {
-    if (is_open(file_name)) {
-        return -1;
-    }
+/**
+ * Check whether a file is open.
+ * @param inode_num The inode number of the file, which must be pinned.
+ * @return True if a file descriptor is open on the file, false otherwise.
+ */
+bool is_open(uint32_t inode_num) {
+    return *open_count_of(inode_num) > 0;
+}
 
+/**
+ * Open a file, creating it if it does not exist.
+ * @param file_name The name of the file.
+ * @return The index of the file descriptor if successful, -1 otherwise.
+ */
+int open_file(const char *const file_name) {
     uint32_t next_free_idx;
+    // Most opens are of files that exist, which only need to read the directory
+    pthread_rwlock_rdlock(&dir_lock);
     uint32_t inode_num = find_inode_num(file_name, &next_free_idx);
 
+    if (inode_num >= MAX_NUM_OF_DIR_ENTRIES) {
+        // Creating the file changes the directory, so look again under the write lock
+        pthread_rwlock_unlock(&dir_lock);
+        pthread_rwlock_wrlock(&dir_lock);
+        inode_num = find_inode_num(file_name, &next_free_idx);
+    }
+
     if (inode_num >= MAX_NUM_OF_DIR_ENTRIES) {
         if (next_free_idx < MAX_NUM_OF_DIR_ENTRIES) {
-            inode_num = get_lowest_inode_num();
-            if (inode_num >= MAX_NUM_OF_DIR_ENTRIES || strlen(file_name) > MAX_FILE_NAME_SIZE) {
+            if (strlen(file_name) > MAX_FILE_NAME_SIZE) {
+                pthread_rwlock_unlock(&dir_lock);
+                return -1;
+            }
+            inode_num = take_inode_num();
+            if (inode_num >= MAX_NUM_OF_DIR_ENTRIES) {
+                pthread_rwlock_unlock(&dir_lock);
                 return -1;
             }
 
-            root_dir[next_free_idx].inode_num = inode_num;
-            strncpy(root_dir[next_free_idx].file_name, file_name, MAX_FILE_NAME_SIZE);
             // Set inode size to 0
-            inode_table[inode_num].size = 0;
-
-            allocate_data_blocks_for_inode(inode_table[super_block.root_dir].size + sizeof(directory_entry_t),
-                                           &inode_table[super_block.root_dir]);
-            write_from_ptr(inode_table[super_block.root_dir], root_dir);
-            // This could be changed to be more efficient, instead of writing all the inodes
-            write_blocks(INODE_BLOCKS_OFFSET, NUM_OF_INODE_BLOCKS, inode_table);
+            pthread_mutex_lock(&inode_table_lock);
+            inode_t *const inode = get_inode(inode_num);
+            if (inode == NULL) {
+                pthread_mutex_unlock(&inode_table_lock);
+                release_inode_num(inode_num);
+                pthread_rwlock_unlock(&dir_lock);
+                return -1;
+            }
+            __atomic_store_n(&inode->size, 0, __ATOMIC_RELEASE);
+            mark_inode_dirty(inode_num);
+            pthread_mutex_unlock(&inode_table_lock);
+
+            if (!allocate_data_blocks_for_inode(dir_entry_position(next_free_idx + 1), super_block.root_dir)) {
+                // The disk or the memory is full, so the directory cannot hold the new entry
+                release_inode_num(inode_num);
+                pthread_mutex_lock(&inode_table_lock);
+                flush_inode_table();
+                pthread_mutex_unlock(&inode_table_lock);
+                pthread_rwlock_unlock(&dir_lock);
+                return -1;
+            }
+            directory_entry_t entry;
+            memset(&entry, 0, sizeof(directory_entry_t));
+            entry.inode_num = inode_num;
+            strncpy(entry.file_name, file_name, MAX_FILE_NAME_SIZE);
+            write_dir_entry(next_free_idx, &entry);
+            dir_index_insert(file_name, next_free_idx);
+            // Only the blocks holding the new inode and the root directory inode are written
+            pthread_mutex_lock(&inode_table_lock);
+            flush_inode_table();
+            pthread_mutex_unlock(&inode_table_lock);
         } else {
+            pthread_rwlock_unlock(&dir_lock);
             return -1;
         }
     }
 
-    const int result = get_next_file_desc_idx(inode_num, inode_table[inode_num].size);
-    return result;
+    int result = -1;
+    pthread_rwlock_wrlock(inode_lock(inode_num));
+    // The inode stays in memory while the file is open
+    const inode_t *const inode = pin_inode(inode_num);
+    if (inode != NULL) {
+        if (!is_open(inode_num)) {
+            result = get_next_file_desc_idx(inode_num, inode->size);
+        }
+        if (result >= 0) {
+            load_block_map(inode_num);
+        } else {
+            unpin_inode(inode_num);
+        }
+    }
+    pthread_rwlock_unlock(inode_lock(inode_num));
+    pthread_rwlock_unlock(&dir_lock);
+    return result;
+}
+
+int sfs_fopen(char *file_name) {
+    // Creating a file changes metadata, which is committed as one operation
+    journal_start();
+    const int result = open_file(file_name);
+    journal_stop();
+    return result;
 }
 
 int sfs_fclose(int fileID) {
-    if (0 > fileID || fileID >= NUM_OF_INODES || file_desc_table[fileID].inode_num >= NUM_OF_INODES) {
+    file_descriptor_entry_t fde;
+    if (!get_file_desc(fileID, &fde)) {
         return -1;
     }
 
+    // Closing a file that was removed while open releases it, which changes metadata
+    journal_start();
+    pthread_rwlock_wrlock(inode_lock(fde.inode_num));
+    pthread_mutex_lock(&file_desc_lock);
+    // Another thread may have closed the file descriptor in the meantime
+    if (file_desc_table[fileID].inode_num != fde.inode_num) {
+        pthread_mutex_unlock(&file_desc_lock);
+        pthread_rwlock_unlock(inode_lock(fde.inode_num));
+        journal_stop();
+        return -1;
+    }
+    const bool is_last = --(*open_count_of(fde.inode_num)) == 0;
     file_desc_table[fileID].inode_num = NUM_OF_INODES;
     file_desc_table[fileID].read_write_ptr = 0;
-    return 0;
+    free_file_descs[num_of_free_file_descs++] = fileID;
+    pthread_mutex_unlock(&file_desc_lock);
+    const bool is_released = is_last && *unlinked_of(fde.inode_num);
+    if (is_released) {
+        *unlinked_of(fde.inode_num) = false;
+        release_file(fde.inode_num);
+    } else if (is_last) {
+        release_block_map(fde.inode_num);
+    }
+    unpin_inode(fde.inode_num);
+    pthread_rwlock_unlock(inode_lock(fde.inode_num));
+    if (is_released) {
+        // Nothing refers to the inode any more, so its number can be taken again
+        pthread_rwlock_wrlock(&dir_lock);
+        release_inode_num(fde.inode_num);
+        pthread_rwlock_unlock(&dir_lock);
+    }
+    journal_stop();
+    // Closing a file makes every change so far durable, together with those of any other thread
+    return journal_commit();
+}
+
+/**
+ * Mark the free bitmap block holding the given bit as changed, with the allocator locked.
+ * @param bit The bit that changed.
+ */
+void mark_free_bitmap_dirty(uint32_t bit) {
+    const uint32_t block = bit / (BLOCK_SIZE * 8);
+    if (!free_bitmap_block_dirty[block]) {
+        free_bitmap_block_dirty[block] = true;
+        dirty_free_bitmap_blocks[num_of_dirty_free_bitmap_blocks++] = block;
+    }
+}
+
+/**
+ * Write the free bitmap blocks that changed since the last flush to the disk, with the allocator locked.
+ */
+void flush_free_bitmap() {
+    for (uint32_t i = 0; i < num_of_dirty_free_bitmap_blocks; ++i) {
+        const uint32_t block = dirty_free_bitmap_blocks[i];
+        journal_write_blocks(FREE_BITMAP_OFFSET + block, 1, ((uint8_t *) free_block_map) + ((size_t) block * BLOCK_SIZE));
+        free_bitmap_block_dirty[block] = false;
+    }
+    num_of_dirty_free_bitmap_blocks = 0;
 }
 
 /**
@@ -359,11 +1239,89 @@ int sfs_fclose(int fileID) {
  * @param bit bit to set.
  */
 void set_bit(uint32_t bit) {
-    const uint32_t size_in_bits = sizeof(int) * 8;
-    const uint32_t arr_idx = bit / size_in_bits;
-    const uint32_t bit_idx = bit % size_in_bits;
+    const uint32_t arr_idx = bit / BITS_PER_MAP_WORD;
+    const uint32_t bit_idx = bit % BITS_PER_MAP_WORD;
     // Set the bit
-    free_block_map[arr_idx] |= (((int) 1) << bit_idx);
+    free_block_map[arr_idx] |= ((uint64_t) 1) << bit_idx;
+    mark_free_bitmap_dirty(bit);
+}
+
+/**
+ * Clear a run of bits from the free bitmap, a word at a time.
+ * @param first The first bit to clear.
+ * @param count The number of bits to clear.
+ */
+void clear_bits(uint32_t first, uint32_t count) {
+    while (count > 0) {
+        const uint32_t bit_idx = first % BITS_PER_MAP_WORD;
+        const uint32_t bits = count < BITS_PER_MAP_WORD - bit_idx ? count : BITS_PER_MAP_WORD - bit_idx;
+        const uint64_t mask = bits == BITS_PER_MAP_WORD ? ~((uint64_t) 0) : ((((uint64_t) 1) << bits) - 1) << bit_idx;
+        free_block_map[first / BITS_PER_MAP_WORD] &= ~mask;
+        mark_free_bitmap_dirty(first);
+        first += bits;
+        count -= bits;
+    }
+}
+
+/**
+ * Find the first data block at or after the given block whose bit in the free bitmap has the given state.
+ * The bitmap is scanned a word at a time, skipping words that hold no matching bit.
+ * @param from The block to start scanning from.
+ * @param free True to look for a free block, false to look for a used block.
+ * @return The block number found, or NUM_OF_DATA_BLOCKS if there is no such block.
+ */
+uint32_t find_block(uint32_t from, bool free) {
+    if (from >= NUM_OF_DATA_BLOCKS) {
+        return NUM_OF_DATA_BLOCKS;
+    }
+    uint32_t arr_idx = from / BITS_PER_MAP_WORD;
+    // Flip the word when looking for used blocks, so that the wanted blocks are always set bits
+    uint64_t word = (free ? free_block_map[arr_idx] : ~free_block_map[arr_idx]) & (~((uint64_t) 0) << (from % BITS_PER_MAP_WORD));
+    while (word == 0) {
+        if (++arr_idx >= FREE_BLOCK_MAP_ARR_SIZE) {
+            return NUM_OF_DATA_BLOCKS;
+        }
+        word = free ? free_block_map[arr_idx] : ~free_block_map[arr_idx];
+    }
+    const uint32_t block = arr_idx * BITS_PER_MAP_WORD + __builtin_ctzll(word);
+    return block < NUM_OF_DATA_BLOCKS ? block : NUM_OF_DATA_BLOCKS;
+}
+
+/**
+ * Allocate a contiguous run of data blocks.
+ * The search is next fit: it starts where the previous allocation ended and wraps around to the start of the disk.
+ * The first free run of the requested length is taken, if there is none the longest free run is taken instead.
+ * @param count The number of blocks wanted.
+ * @param first A pointer to be populated with the first data block of the run.
+ * @return The number of blocks allocated, which is at most count. Returns 0 when the disk is fully allocated.
+ */
+uint32_t allocate_data_blocks(uint32_t count, uint32_t *const first) {
+    uint32_t best_start = NUM_OF_DATA_BLOCKS;
+    uint32_t best_length = 0;
+    for (int pass = 0; pass < 2 && best_length < count; ++pass) {
+        const uint32_t end = pass == 0 ? NUM_OF_DATA_BLOCKS : next_fit_block;
+        uint32_t block = find_block(pass == 0 ? next_fit_block : 0, true);
+        while (block < end) {
+            const uint32_t limit = NUM_OF_DATA_BLOCKS - block > count ? block + count : NUM_OF_DATA_BLOCKS;
+            uint32_t run_end = find_block(block, false);
+            run_end = run_end < limit ? run_end : limit;
+            if (run_end - block > best_length) {
+                best_start = block;
+                best_length = run_end - block;
+                if (best_length == count) {
+                    break;
+                }
+            }
+            block = find_block(run_end, true);
+        }
+    }
+
+    if (best_length > 0) {
+        clear_bits(best_start, best_length);
+        next_fit_block = best_start + best_length < NUM_OF_DATA_BLOCKS ? best_start + best_length : 0;
+    }
+    *first = best_start;
+    return best_length;
 }
 
 /**
@@ -371,28 +1329,153 @@ void set_bit(uint32_t bit) {
  * Returns NUM_OF_DATA_BLOCKS if unsuccessful, when the disk is fully allocated.
  */
 uint32_t allocate_data_block() {
-    const int limit = sizeof(int) * 8;
-    for (int i = 0; i < FREE_BLOCK_MAP_ARR_SIZE; ++i) {
-        for (int j = 0; j < limit; ++j) {
-            // Check the bit
-            if ((free_block_map[i] >> j) & ((int) 1)) {
-                // Clear the bit
-                free_block_map[i] &= ~(((int) 1) << j);
-                return limit * i + j;
-            }
+    uint32_t data_block_num;
+    return allocate_data_blocks(1, &data_block_num) == 1 ? data_block_num : NUM_OF_DATA_BLOCKS;
+}
+
+/**
+ * Count the pointer blocks a file of the given number of blocks needs.
+ * A pointer block exists exactly when at least one of the blocks it covers is in use.
+ * @param num_of_blocks The number of blocks used by the file.
+ * @return The number of indirect, double indirect and triple indirect pointer blocks needed.
+ */
+uint32_t count_pointer_blocks(uint32_t num_of_blocks) {
+    uint32_t result = 0;
+    if (num_of_blocks > NUM_OF_DATA_PTRS) {
+        result++;
+    }
+    if (num_of_blocks > DOUBLE_INDIRECT_START) {
+        const uint32_t covered = num_of_blocks - DOUBLE_INDIRECT_START;
+        const uint32_t blocks = covered < NUM_OF_DOUBLE_INDIRECT_PTRS ? covered : NUM_OF_DOUBLE_INDIRECT_PTRS;
+        result += 1 + CEIL(blocks, INDIRECT_LIST_SIZE);
+    }
+    if (num_of_blocks > TRIPLE_INDIRECT_START) {
+        const uint32_t covered = num_of_blocks - TRIPLE_INDIRECT_START;
+        result += 1 + CEIL(covered, NUM_OF_DOUBLE_INDIRECT_PTRS) + CEIL(covered, INDIRECT_LIST_SIZE);
+    }
+    return result;
+}
+
+/**
+ * Allocate data blocks into a list, in as few contiguous runs as the free bitmap allows.
+ * @param blocks A pointer to be populated with the allocated data block numbers.
+ * @param count The number of data blocks to allocate.
+ * @return The number of data blocks allocated, which is less than count when the disk is full.
+ */
+uint32_t allocate_block_list(uint32_t *const blocks, uint32_t count) {
+    uint32_t allocated = 0;
+    while (allocated < count) {
+        uint32_t first;
+        const uint32_t length = allocate_data_blocks(count - allocated, &first);
+        if (length == 0) {
+            break;
+        }
+        for (uint32_t j = 0; j < length; ++j) {
+            blocks[allocated++] = first + j;
         }
     }
-    return NUM_OF_DATA_BLOCKS;
+    return allocated;
+}
+
+/**
+ * Load a pointer block into a buffer, writing back the pointer block it held before if that changed.
+ * @param pointer_block The buffer to load into.
+ * @param block The data block number of the pointer block.
+ * @param fresh True if the pointer block was just allocated, so it is cleared instead of read.
+ */
+void load_pointer_block(pointer_block_t *const pointer_block, uint32_t block, bool fresh) {
+    if (pointer_block->block == block) {
+        return;
+    }
+    store_pointer_block(pointer_block);
+    pointer_block->block = block;
+    if (fresh) {
+        for (uint32_t i = 0; i < INDIRECT_LIST_SIZE; ++i) {
+            pointer_block->ptrs[i] = NUM_OF_DATA_BLOCKS;  // Initialise an invalid number
+        }
+        pointer_block->dirty = true;
+    } else {
+        journal_read_blocks(DATA_BLOCKS_OFFSET + block, 1, pointer_block->ptrs);
+        pointer_block->dirty = false;
+    }
+}
+
+/**
+ * Write a pointer block held in a buffer to the disk if it changed.
+ * @param pointer_block The buffer holding the pointer block.
+ */
+void store_pointer_block(pointer_block_t *const pointer_block) {
+    if (pointer_block->block < NUM_OF_DATA_BLOCKS && pointer_block->dirty) {
+        journal_write_blocks(DATA_BLOCKS_OFFSET + pointer_block->block, 1, pointer_block->ptrs);
+    }
+    pointer_block->dirty = false;
+}
+
+/**
+ * Get the pointer block holding the pointer to a given block of a file, allocating pointer blocks as needed.
+ * Pointer blocks are allocated when the first block they cover is allocated, so blocks must be added in order.
+ * @param inode The inode of the file.
+ * @param block The index of the block within the file, past the direct pointers.
+ * @param levels The buffers of the pointer blocks on the path to the block, from the one holding the data pointer up.
+ * @param next_pointer_block A pointer to the next pre-allocated block to use for new pointer blocks.
+ * @return The index of the pointer to the block within levels[0].
+ */
+uint32_t load_pointer_path(inode_t *const inode, uint32_t block, pointer_block_t *const levels,
+                           uint32_t **const next_pointer_block) {
+    if (block < DOUBLE_INDIRECT_START) {
+        const uint32_t idx = block - NUM_OF_DATA_PTRS;
+        if (idx == 0) {
+            inode->indirect = *(*next_pointer_block)++;
+        }
+        load_pointer_block(&levels[0], inode->indirect, idx == 0);
+        return idx;
+    }
+    if (block < TRIPLE_INDIRECT_START) {
+        const uint32_t idx = block - DOUBLE_INDIRECT_START;
+        if (idx == 0) {
+            inode->double_indirect = *(*next_pointer_block)++;
+        }
+        load_pointer_block(&levels[1], inode->double_indirect, idx == 0);
+        if (idx % INDIRECT_LIST_SIZE == 0) {
+            levels[1].ptrs[idx / INDIRECT_LIST_SIZE] = *(*next_pointer_block)++;
+            levels[1].dirty = true;
+        }
+        load_pointer_block(&levels[0], levels[1].ptrs[idx / INDIRECT_LIST_SIZE], idx % INDIRECT_LIST_SIZE == 0);
+        return idx % INDIRECT_LIST_SIZE;
+    }
+    const uint32_t idx = block - TRIPLE_INDIRECT_START;
+    if (idx == 0) {
+        inode->triple_indirect = *(*next_pointer_block)++;
+    }
+    load_pointer_block(&levels[2], inode->triple_indirect, idx == 0);
+    if (idx % NUM_OF_DOUBLE_INDIRECT_PTRS == 0) {
+        levels[2].ptrs[idx / NUM_OF_DOUBLE_INDIRECT_PTRS] = *(*next_pointer_block)++;
+        levels[2].dirty = true;
+    }
+    load_pointer_block(&levels[1], levels[2].ptrs[idx / NUM_OF_DOUBLE_INDIRECT_PTRS],
+                       idx % NUM_OF_DOUBLE_INDIRECT_PTRS == 0);
+    const uint32_t mid_idx = (idx / INDIRECT_LIST_SIZE) % INDIRECT_LIST_SIZE;
+    if (idx % INDIRECT_LIST_SIZE == 0) {
+        levels[1].ptrs[mid_idx] = *(*next_pointer_block)++;
+        levels[1].dirty = true;
+    }
+    load_pointer_block(&levels[0], levels[1].ptrs[mid_idx], idx % INDIRECT_LIST_SIZE == 0);
+    return idx % INDIRECT_LIST_SIZE;
 }
 
 /**
  * Allocate data blocks for an inode as needed.
+ * The new data blocks are allocated as contiguous runs where possible, followed by the pointer blocks they need,
+ * and any blocks allocated are released again if the allocation cannot be completed.
  * @param final_size The desired size of the file after allocating the data blocks.
- * @param inode The inode to allocate data blocks for.
+ * @param inode_num The number of the inode to allocate data blocks for, which must be pinned.
  * @return True if successful, false if unsuccessful.
  */
-bool allocate_data_blocks_for_inode(uint32_t final_size, inode_t *const inode) {
+bool allocate_data_blocks_for_inode(uint32_t final_size, uint32_t inode_num) {
+    inode_t *const inode = pinned_inode(inode_num);
     if (final_size > inode->size) {
+        // Pointers are added to a copy, which is put in the inode table once it is complete
+        inode_t updated = *inode;
         // Number of blocks to allocate
         const uint32_t blocks_used = CEIL(inode->size, BLOCK_SIZE);
         const uint32_t final_blocks_used = CEIL(final_size, BLOCK_SIZE);
@@ -400,222 +1483,697 @@ bool allocate_data_blocks_for_inode(uint32_t final_size, inode_t *const inode) {
         if (final_blocks_used > MAX_DATA_BLOCKS_FOR_FILE) {
             return false;
         }
-        uint32_t i;
-        // Allocate disk blocks
-        for (i = blocks_used; i < final_blocks_used && i < NUM_OF_DATA_PTRS; ++i) {
-            const uint32_t data_block_num = allocate_data_block();
-            if (data_block_num >= NUM_OF_DATA_BLOCKS) {
+        if (final_blocks_used > blocks_used) {
+            const uint32_t num_of_new_blocks = final_blocks_used - blocks_used;
+            const uint32_t num_of_new_pointer_blocks =
+                    count_pointer_blocks(final_blocks_used) - count_pointer_blocks(blocks_used);
+            const uint32_t total = num_of_new_blocks + num_of_new_pointer_blocks;
+            uint32_t *const new_blocks = malloc(total * sizeof(uint32_t));
+            if (new_blocks == NULL) {
                 return false;
             }
-            inode->data_ptrs[i] = data_block_num;
-        }
-        if (final_blocks_used > NUM_OF_DATA_PTRS) {
-            const uint32_t start = blocks_used > NUM_OF_DATA_PTRS ? blocks_used - NUM_OF_DATA_PTRS : 0;
-            const uint32_t limit = final_blocks_used - NUM_OF_DATA_PTRS;
-            uint32_t ptrs[INDIRECT_LIST_SIZE];
-            if (start > 0) {
-                // Getting the indirect pointers
-                read_blocks(DATA_BLOCKS_OFFSET + inode->indirect, 1, ptrs);
-            } else {
-                // Allocate a data block for the indirect pointers
-                const uint32_t data_block_num = allocate_data_block();
-                if (data_block_num >= NUM_OF_DATA_BLOCKS) {
-                    return false;
+            // The pointer blocks are allocated after the data blocks, so that they do not split their runs
+            pthread_mutex_lock(&alloc_lock);
+            const uint32_t allocated = allocate_block_list(new_blocks, total);
+            if (allocated < total) {
+                for (uint32_t j = 0; j < allocated; ++j) {
+                    set_bit(new_blocks[j]);
                 }
-                inode->indirect = data_block_num;
+                pthread_mutex_unlock(&alloc_lock);
+                free(new_blocks);
+                return false;
+            }
+            pthread_mutex_unlock(&alloc_lock);
+
+            // Keep a loaded block map in step, so the new blocks do not have to be looked up again
+            block_map_t *const map = block_map_of(inode_num);
+            if (map->count > blocks_used) {
+                // Blocks past the end of the file are mapped again from here
+                map->count = blocks_used;
+            }
+            if (map->blocks != NULL && map->count == blocks_used && reserve_block_map(map, final_blocks_used)) {
+                memcpy(map->blocks + blocks_used, new_blocks, num_of_new_blocks * sizeof(uint32_t));
+                map->count = final_blocks_used;
             }
-            // Update the indirect pointer list
-            for (i = start; i < limit && i < INDIRECT_LIST_SIZE; ++i) {
-                const uint32_t data_block_num = allocate_data_block();
-                if (data_block_num >= NUM_OF_DATA_BLOCKS) {
-                    return false;
+
+            uint32_t *next_pointer_block = new_blocks + num_of_new_blocks;
+            pointer_block_t levels[3];
+            for (int j = 0; j < 3; ++j) {
+                levels[j].block = NUM_OF_DATA_BLOCKS;
+                levels[j].dirty = false;
+            }
+            for (uint32_t i = blocks_used; i < final_blocks_used; ++i) {
+                const uint32_t data_block_num = new_blocks[i - blocks_used];
+                if (i < NUM_OF_DATA_PTRS) {
+                    updated.data_ptrs[i] = data_block_num;
+                } else {
+                    const uint32_t idx = load_pointer_path(&updated, i, levels, &next_pointer_block);
+                    levels[0].ptrs[idx] = data_block_num;
+                    levels[0].dirty = true;
                 }
-                ptrs[i] = data_block_num;
             }
-            // Write the new indirect pinter list to the disk
-            write_blocks(DATA_BLOCKS_OFFSET + inode->indirect, 1, ptrs);
+            // Write the new pointer lists to the disk
+            for (int j = 0; j < 3; ++j) {
+                store_pointer_block(&levels[j]);
+            }
+            free(new_blocks);
+            // Write free bitmap to disk
+            pthread_mutex_lock(&alloc_lock);
+            flush_free_bitmap();
+            pthread_mutex_unlock(&alloc_lock);
         }
+        pthread_mutex_lock(&inode_table_lock);
+        memcpy(inode->data_ptrs, updated.data_ptrs, sizeof(updated.data_ptrs));
+        inode->indirect = updated.indirect;
+        inode->double_indirect = updated.double_indirect;
+        inode->triple_indirect = updated.triple_indirect;
         // Update the size of the inode
-        inode->size = final_size;
+        __atomic_store_n(&inode->size, final_size, __ATOMIC_RELEASE);
         // Write inode to disk
-        write_blocks(INODE_BLOCKS_OFFSET, NUM_OF_INODE_BLOCKS, inode_table);
-        // Write free bitmap to disk
-        write_blocks(FREE_BITMAP_OFFSET, NUM_OF_FREE_BITMAP_BLOCKS, free_block_map);
+        mark_inode_dirty(inode_num);
+        flush_inode_table();
+        pthread_mutex_unlock(&inode_table_lock);
     }
     return true;
 }
 
 /**
- * Note: When the length of bytes to be written is impossible to write,
- * i.e. when it would cause the file to grow larger than the maximum size for a file,
- * I chose to not write any bytes and not allocate any extra data blocks to the file,
- * returning 0 as the amount of bytes written.
+ * Find the pointer block holding the pointer to a given block of a file, reading the pointer blocks above it.
+ * @param inode The inode of the file.
+ * @param block The index of the block within the file, past the direct pointers.
+ * @param idx A pointer to be populated with the index of the pointer within the pointer block.
+ * @return The data block number of the pointer block.
  */
-int sfs_fwrite(int fileID, char *buf, int length) {
-    if (0 > fileID || fileID >= NUM_OF_INODES) {
-        return 0;
+uint32_t get_pointer_block(const inode_t *const inode, uint32_t block, uint32_t *const idx) {
+    uint32_t ptrs[INDIRECT_LIST_SIZE];
+    if (block < DOUBLE_INDIRECT_START) {
+        *idx = block - NUM_OF_DATA_PTRS;
+        return inode->indirect;
+    }
+    if (block < TRIPLE_INDIRECT_START) {
+        block -= DOUBLE_INDIRECT_START;
+        *idx = block % INDIRECT_LIST_SIZE;
+        journal_read_blocks(DATA_BLOCKS_OFFSET + inode->double_indirect, 1, ptrs);
+        return ptrs[block / INDIRECT_LIST_SIZE];
     }
+    block -= TRIPLE_INDIRECT_START;
+    *idx = block % INDIRECT_LIST_SIZE;
+    journal_read_blocks(DATA_BLOCKS_OFFSET + inode->triple_indirect, 1, ptrs);
+    journal_read_blocks(DATA_BLOCKS_OFFSET + ptrs[block / NUM_OF_DOUBLE_INDIRECT_PTRS], 1, ptrs);
+    return ptrs[(block / INDIRECT_LIST_SIZE) % INDIRECT_LIST_SIZE];
+}
 
-    const file_descriptor_entry_t fde = file_desc_table[fileID];
-    if (fde.inode_num >= NUM_OF_INODES) {
-        return 0;
+/**
+ * Look up the data blocks holding a range of blocks of a file.
+ * @param inode The inode of the file.
+ * @param first The index of the first block within the file.
+ * @param count The number of blocks to look up, all of which must be allocated.
+ * @param blocks A pointer to be populated with the data block numbers.
+ */
+void get_data_blocks(const inode_t *const inode, uint32_t first, uint32_t count, uint32_t *const blocks) {
+    uint32_t i;
+    for (i = 0; i < count && first + i < NUM_OF_DATA_PTRS; ++i) {
+        blocks[i] = inode->data_ptrs[first + i];
+    }
+    uint32_t ptrs[INDIRECT_LIST_SIZE];
+    uint32_t ptrs_idx = INDIRECT_LIST_SIZE;
+    for (; i < count; ++i) {
+        // The pointer list only needs to be looked up again when the previous one runs out
+        if (ptrs_idx == INDIRECT_LIST_SIZE || first + i == DOUBLE_INDIRECT_START) {
+            journal_read_blocks(DATA_BLOCKS_OFFSET + get_pointer_block(inode, first + i, &ptrs_idx), 1, ptrs);
+        }
+        blocks[i] = ptrs[ptrs_idx++];
     }
+}
 
-    if (!allocate_data_blocks_for_inode(fde.read_write_ptr + length, &inode_table[fde.inode_num])) {
-        return 0;
+/**
+ * Make sure a block map has room for a number of blocks.
+ * @param map The block map.
+ * @param num_of_blocks The number of blocks the map must be able to hold.
+ * @return True if successful, false if unsuccessful.
+ */
+bool reserve_block_map(block_map_t *const map, uint32_t num_of_blocks) {
+    if (map->blocks != NULL && num_of_blocks <= map->capacity) {
+        return true;
+    }
+    uint32_t capacity = map->capacity > 0 ? map->capacity : BLOCK_BATCH_SIZE;
+    while (capacity < num_of_blocks) {
+        capacity *= 2;
     }
+    uint32_t *const blocks = realloc(map->blocks, capacity * sizeof(uint32_t));
+    if (blocks == NULL) {
+        return false;
+    }
+    map->blocks = blocks;
+    map->capacity = capacity;
+    return true;
+}
 
-    // Need to have an offset
-    const int blocks_used = CEIL(inode_table[fde.inode_num].size, BLOCK_SIZE);
-    const uint32_t start_block = fde.read_write_ptr / BLOCK_SIZE;
-    uint32_t offset = fde.read_write_ptr % BLOCK_SIZE;
-    uint32_t result = 0;
-    char *const temp_buf = calloc(sizeof(char), BLOCK_SIZE);
-    for (uint32_t i = start_block;
-         i < NUM_OF_DATA_PTRS && i < blocks_used && result < length; ++i) {
-
-        read_blocks(DATA_BLOCKS_OFFSET + inode_table[fde.inode_num].data_ptrs[i], 1, temp_buf);
-        const uint32_t diff = length - result;
-        // Example: offset is 900, but want to write 800 bytes
-        // diff = 800
-        // bytes_written = (should equal 1024 - 900) 124
-        // next time the offset will be 0 and the diff will be (900 - 124)
-        const uint32_t bytes_written = diff + offset >= BLOCK_SIZE ? BLOCK_SIZE - offset : diff;
-
-        memcpy(temp_buf + offset, buf + result, bytes_written);
-        write_blocks(DATA_BLOCKS_OFFSET + inode_table[fde.inode_num].data_ptrs[i], 1, temp_buf);
-
-        result += bytes_written;
-        offset = 0;
-    }
-    if (blocks_used > NUM_OF_DATA_PTRS && result < length) {
-        const uint32_t num_of_ptrs = blocks_used - NUM_OF_DATA_PTRS;
-        uint32_t ptrs[INDIRECT_LIST_SIZE];
-        // Getting the indirect pointers
-        read_blocks(DATA_BLOCKS_OFFSET + inode_table[fde.inode_num].indirect, 1, ptrs);
-        for (uint32_t i = start_block > NUM_OF_DATA_PTRS ? start_block - NUM_OF_DATA_PTRS : 0;
-             i < num_of_ptrs && result < length; ++i) {
+/**
+ * Drop the block map of a pinned inode.
+ * @param inode_num The number of the inode.
+ */
+void release_block_map(uint32_t inode_num) {
+    block_map_t *const map = block_map_of(inode_num);
+    free(map->blocks);
+    map->blocks = NULL;
+    map->count = 0;
+    map->capacity = 0;
+}
+
+/**
+ * Fill in the block map of an inode from its pointer blocks, with the inode locked for writing.
+ * Files get their block map when they are opened and the root directory when it is mounted,
+ * so the pointer blocks are only read once while the file stays open.
+ * @param inode_num The number of the inode.
+ */
+void load_block_map(uint32_t inode_num) {
+    const inode_t *const inode = pinned_inode(inode_num);
+    block_map_t *const map = block_map_of(inode_num);
+    const uint32_t blocks_used = CEIL(inode->size, BLOCK_SIZE);
+    if (map->count < blocks_used && reserve_block_map(map, blocks_used)) {
+        get_data_blocks(inode, map->count, blocks_used - map->count, map->blocks + map->count);
+        map->count = blocks_used;
+    } else if (map->blocks == NULL) {
+        reserve_block_map(map, 0);
+    }
+}
+
+/**
+ * Look up the data blocks holding a range of blocks of a file.
+ * Blocks covered by the block map of the inode are taken from it, others are looked up in the pointer blocks.
+ * The block map is only read here, so this is safe with the inode locked for reading.
+ * @param inode_num The number of the inode of the file.
+ * @param first The index of the first block within the file.
+ * @param count The number of blocks to look up, all of which must be allocated.
+ * @param blocks A pointer to be populated with the data block numbers.
+ */
+void lookup_data_blocks(uint32_t inode_num, uint32_t first, uint32_t count, uint32_t *const blocks) {
+    const block_map_t *const map = block_map_of(inode_num);
+    if (first + count > map->count) {
+        get_data_blocks(pinned_inode(inode_num), first, count, blocks);
+        return;
+    }
+    memcpy(blocks, map->blocks + first, count * sizeof(uint32_t));
+}
 
-            read_blocks(DATA_BLOCKS_OFFSET + ptrs[i], 1, temp_buf);
+/**
+ * Read data blocks of a file. The root directory is metadata, so its blocks are read through the journal.
+ * @param inode_num The number of the inode of the file.
+ * @param first The first data block to read.
+ * @param count The number of data blocks to read.
+ * @param buf The buffer to read into.
+ */
+void read_data_blocks(uint32_t inode_num, uint32_t first, uint32_t count, void *const buf) {
+    if (inode_num == super_block.root_dir) {
+        journal_read_blocks(DATA_BLOCKS_OFFSET + first, count, buf);
+    } else {
+        cache_read_blocks(DATA_BLOCKS_OFFSET + first, count, buf);
+    }
+}
+
+/**
+ * Write data blocks of a file. The root directory is metadata, so its blocks are written through the journal.
+ * @param inode_num The number of the inode of the file.
+ * @param first The first data block to write.
+ * @param count The number of data blocks to write.
+ * @param buf The buffer to write from.
+ */
+void write_data_blocks(uint32_t inode_num, uint32_t first, uint32_t count, const void *const buf) {
+    if (inode_num == super_block.root_dir) {
+        journal_write_blocks(DATA_BLOCKS_OFFSET + first, count, buf);
+    } else {
+        cache_write_blocks(DATA_BLOCKS_OFFSET + first, count, buf);
+    }
+}
+
+/**
+ * Write a buffer into the data blocks of a file, which must already be allocated.
+ * Whole blocks are written without reading them first, and runs of them that are adjacent on the disk
+ * are written with a single call. Only partial blocks at the start and the end are read, modified and written.
+ * @param inode_num The number of the inode of the file.
+ * @param position The position in the file to write at.
+ * @param buf The buffer to write from.
+ * @param length The number of bytes to write.
+ * @return The number of bytes written.
+ */
+uint32_t write_file_data(uint32_t inode_num, uint32_t position, const char *const buf, uint32_t length) {
+    uint32_t blocks[BLOCK_BATCH_SIZE];
+    uint8_t block_buf[BLOCK_SIZE];
+    const uint32_t last_block = (position + length - 1) / BLOCK_SIZE;
+    uint32_t block = position / BLOCK_SIZE;
+    uint32_t offset = position % BLOCK_SIZE;
+    uint32_t result = 0;
+    while (result < length) {
+        const uint32_t batch = last_block - block + 1 < BLOCK_BATCH_SIZE ? last_block - block + 1 : BLOCK_BATCH_SIZE;
+        lookup_data_blocks(inode_num, block, batch, blocks);
+        uint32_t i = 0;
+        while (i < batch) {
             const uint32_t diff = length - result;
-            const uint32_t bytes_written = diff + offset >= BLOCK_SIZE ? BLOCK_SIZE - offset : diff;
+            if (offset == 0 && diff >= BLOCK_SIZE) {
+                // Extend the run for as long as the next block is whole and follows on the disk
+                uint32_t run = 1;
+                while (i + run < batch && blocks[i + run] == blocks[i] + run && diff - run * BLOCK_SIZE >= BLOCK_SIZE) {
+                    run++;
+                }
+                write_data_blocks(inode_num, blocks[i], run, buf + result);
+                result += run * BLOCK_SIZE;
+                i += run;
+            } else {
+                // Example: offset is 900, but want to write 800 bytes
+                // diff = 800
+                // bytes_written = (should equal 1024 - 900) 124
+                // next time the offset will be 0 and the diff will be (900 - 124)
+                const uint32_t bytes_written = diff + offset >= BLOCK_SIZE ? BLOCK_SIZE - offset : diff;
+                read_data_blocks(inode_num, blocks[i], 1, block_buf);
+                memcpy(block_buf + offset, buf + result, bytes_written);
+                write_data_blocks(inode_num, blocks[i], 1, block_buf);
+                result += bytes_written;
+                offset = 0;
+                i++;
+            }
+        }
+        block += batch;
+    }
+    return result;
+}
 
-            memcpy(temp_buf + offset, buf + result, bytes_written);
-            write_blocks(DATA_BLOCKS_OFFSET + ptrs[i], 1, temp_buf);
+/**
+ * Fill a range of a file with zeros, a block at a time, its data blocks must already be allocated.
+ * Blocks a file gets may hold the data of a deleted file, so any part of them it does not write is cleared.
+ * @param inode_num The number of the inode of the file.
+ * @param position The position in the file the range starts at.
+ * @param end The position in the file the range ends at.
+ */
+void zero_file_data(uint32_t inode_num, uint32_t position, uint32_t end) {
+    const char zeros[BLOCK_SIZE] = {0};
+    while (position < end) {
+        const uint32_t length = end - position < BLOCK_SIZE - position % BLOCK_SIZE
+                                ? end - position : BLOCK_SIZE - position % BLOCK_SIZE;
+        position += write_file_data(inode_num, position, zeros, length);
+    }
+}
 
-            result += bytes_written;
-            offset = 0;
+/**
+ * Write to a file at a given position, allocating the data blocks it needs.
+ * @param inode_num The number of the inode of the file.
+ * @param position The position in the file to write at.
+ * @param buf The buffer to write from.
+ * @param length The number of bytes to write, which must be positive.
+ * @return The number of bytes written, 0 if the file cannot grow to hold them.
+ */
+uint32_t write_to_file(uint32_t inode_num, uint32_t position, const char *const buf, uint32_t length) {
+    if ((uint64_t) position + length > MAX_FILE_SIZE) {
+        return 0;
+    }
+
+    journal_start();
+    pthread_rwlock_wrlock(inode_lock(inode_num));
+    uint32_t result = 0;
+    const uint32_t old_size = pinned_inode(inode_num)->size;
+    if (allocate_data_blocks_for_inode(position + length, inode_num)) {
+        // A write past the end of the file leaves a gap, which reads as zeros
+        if (position > old_size) {
+            zero_file_data(inode_num, old_size, position);
         }
+        result = write_file_data(inode_num, position, buf, length);
     }
+    pthread_rwlock_unlock(inode_lock(inode_num));
+    journal_stop();
+    return result;
+}
 
+/**
+ * Note: When the length of bytes to be written is impossible to write,
+ * i.e. when it would cause the file to grow larger than the maximum size for a file,
+ * I chose to not write any bytes and not allocate any extra data blocks to the file,
+ * returning 0 as the amount of bytes written.
+ */
+int sfs_fwrite(int fileID, char *buf, int length) {
+    file_descriptor_entry_t fde;
+    if (length <= 0 || !get_file_desc(fileID, &fde)) {
+        return 0;
+    }
+
+    const uint32_t result = write_to_file(fde.inode_num, fde.read_write_ptr, buf, length);
+
+    pthread_mutex_lock(&file_desc_lock);
     file_desc_table[fileID].read_write_ptr += result;
+    pthread_mutex_unlock(&file_desc_lock);
     return (int) result;
 }
 
-int sfs_fread(int fileID, char *buf, int length) {
-    if (0 > fileID || fileID >= NUM_OF_INODES) {
+/**
+ * Write to a file at a given position, leaving the read and write pointer of the file descriptor alone.
+ * Fails in the same way as sfs_fwrite.
+ * @param fileID The file descriptor to write to.
+ * @param buf The buffer to write from.
+ * @param length The number of bytes to write.
+ * @param offset The position in the file to write at.
+ * @return The number of bytes written.
+ */
+int sfs_pwrite(int fileID, const char *buf, int length, int offset) {
+    file_descriptor_entry_t fde;
+    if (length <= 0 || offset < 0 || !get_file_desc(fileID, &fde)) {
         return 0;
     }
 
-    const file_descriptor_entry_t fde = file_desc_table[fileID];
-    if (fde.inode_num >= NUM_OF_INODES) {
-        return 0;
-    }
-    const inode_t inode = inode_table[fde.inode_num];
+    return (int) write_to_file(fde.inode_num, offset, buf, length);
+}
 
-    const int blocks_used = CEIL(inode.size, BLOCK_SIZE);
-    const uint32_t start_block = fde.read_write_ptr / BLOCK_SIZE;
+/**
+ * Read the data blocks of a file into a buffer.
+ * Whole blocks are read straight into the buffer, and runs of them that are adjacent on the disk
+ * are read with a single call. Only partial blocks at the start and the end go through a block sized buffer.
+ * @param inode_num The number of the inode of the file.
+ * @param position The position in the file to read from.
+ * @param buf The buffer to read into.
+ * @param length The number of bytes to read, which must not go past the end of the file.
+ * @return The number of bytes read.
+ */
+uint32_t read_file_data(uint32_t inode_num, uint32_t position, char *const buf, uint32_t length) {
+    uint32_t blocks[BLOCK_BATCH_SIZE];
+    uint8_t block_buf[BLOCK_SIZE];
+    const uint32_t last_block = (position + length - 1) / BLOCK_SIZE;
+    uint32_t block = position / BLOCK_SIZE;
     // This will be set to 0 once it's not the first read
     // The idea is that if the pointer is in the middle of a block,
     // we should offset the first read, and only read into the buffer bytes after the pointer
-    uint32_t offset = fde.read_write_ptr % BLOCK_SIZE;
-    // Don't read past the EOF
-    const int max_bytes_to_read = (int) (inode.size - fde.read_write_ptr);
-    length = length > max_bytes_to_read ? max_bytes_to_read : length;
+    uint32_t offset = position % BLOCK_SIZE;
     uint32_t result = 0;
-    char *const temp_buf = calloc(sizeof(char), BLOCK_SIZE);
-    for (uint32_t i = start_block;
-         i < NUM_OF_DATA_PTRS && i < blocks_used && result < length; ++i) {
-        // Read each data block one by one
-        read_blocks(DATA_BLOCKS_OFFSET + inode.data_ptrs[i], 1, temp_buf);
-
-        const uint32_t diff = length - result;
-        const uint32_t bytes_read = diff + offset >= BLOCK_SIZE ? BLOCK_SIZE - offset : diff;
-        memcpy(buf + result, temp_buf + offset, bytes_read);
-        result += bytes_read;
-        offset = 0;
-    }
-    if (blocks_used > NUM_OF_DATA_PTRS && result < length) {
-        const uint32_t num_of_ptrs = blocks_used - NUM_OF_DATA_PTRS;
-        uint32_t ptrs[INDIRECT_LIST_SIZE];
-        // Getting the indirect pointers
-        read_blocks(DATA_BLOCKS_OFFSET + inode.indirect, 1, ptrs);
-        // Read each data block one by one
-        for (uint32_t i = start_block > NUM_OF_DATA_PTRS ? start_block - NUM_OF_DATA_PTRS : 0;
-             i < num_of_ptrs && result < length; ++i) {
-            read_blocks(DATA_BLOCKS_OFFSET + ptrs[i], 1, temp_buf);
-
+    while (result < length) {
+        const uint32_t batch = last_block - block + 1 < BLOCK_BATCH_SIZE ? last_block - block + 1 : BLOCK_BATCH_SIZE;
+        lookup_data_blocks(inode_num, block, batch, blocks);
+        uint32_t i = 0;
+        while (i < batch) {
             const uint32_t diff = length - result;
-            const uint32_t bytes_read = diff + offset >= BLOCK_SIZE ? BLOCK_SIZE - offset : diff;
-            memcpy(buf + result, temp_buf + offset, bytes_read);
-            result += bytes_read;
-            offset = 0;
+            if (offset == 0 && diff >= BLOCK_SIZE) {
+                // Extend the run for as long as the next block is whole and follows on the disk
+                uint32_t run = 1;
+                while (i + run < batch && blocks[i + run] == blocks[i] + run && diff - run * BLOCK_SIZE >= BLOCK_SIZE) {
+                    run++;
+                }
+                read_data_blocks(inode_num, blocks[i], run, buf + result);
+                result += run * BLOCK_SIZE;
+                i += run;
+            } else {
+                const uint32_t bytes_read = diff + offset >= BLOCK_SIZE ? BLOCK_SIZE - offset : diff;
+                read_data_blocks(inode_num, blocks[i], 1, block_buf);
+                memcpy(buf + result, block_buf + offset, bytes_read);
+                result += bytes_read;
+                offset = 0;
+                i++;
+            }
         }
+        block += batch;
     }
+    return result;
+}
+
+/**
+ * Read from a file at a given position, stopping at the end of the file.
+ * @param inode_num The number of the inode of the file.
+ * @param position The position in the file to read from.
+ * @param buf The buffer to read into.
+ * @param length The number of bytes to read.
+ * @return The number of bytes read.
+ */
+uint32_t read_from_file(uint32_t inode_num, uint32_t position, char *const buf, int length) {
+    // Readers of the same file share its lock, so they run at the same time
+    pthread_rwlock_rdlock(inode_lock(inode_num));
+    const inode_t *const inode = pinned_inode(inode_num);
 
+    // Don't read past the EOF
+    const int64_t max_bytes_to_read = (int64_t) inode->size - position;
+    const int64_t bytes_to_read = length > max_bytes_to_read ? max_bytes_to_read : length;
+    if (bytes_to_read <= 0) {
+        pthread_rwlock_unlock(inode_lock(inode_num));
+        return 0;
+    }
+
+    const uint32_t result = read_file_data(inode_num, position, buf, bytes_to_read);
+    pthread_rwlock_unlock(inode_lock(inode_num));
+    return result;
+}
+
+int sfs_fread(int fileID, char *buf, int length) {
+    file_descriptor_entry_t fde;
+    if (!get_file_desc(fileID, &fde)) {
+        return 0;
+    }
+
+    const uint32_t result = read_from_file(fde.inode_num, fde.read_write_ptr, buf, length);
+
+    pthread_mutex_lock(&file_desc_lock);
     file_desc_table[fileID].read_write_ptr += result;
+    pthread_mutex_unlock(&file_desc_lock);
     return (int) result;
 }
 
+/**
+ * Read from a file at a given position, leaving the read and write pointer of the file descriptor alone.
+ * @param fileID The file descriptor to read from.
+ * @param buf The buffer to read into.
+ * @param length The number of bytes to read.
+ * @param offset The position in the file to read from.
+ * @return The number of bytes read, which is less than length at the end of the file.
+ */
+int sfs_pread(int fileID, char *buf, int length, int offset) {
+    file_descriptor_entry_t fde;
+    if (offset < 0 || !get_file_desc(fileID, &fde)) {
+        return 0;
+    }
+
+    return (int) read_from_file(fde.inode_num, offset, buf, length);
+}
+
 int sfs_fseek(int fileID, int location) {
-    if (0 > fileID || fileID >= NUM_OF_INODES || file_desc_table[fileID].inode_num >= NUM_OF_INODES) {
+    if (0 > fileID) {
         return -1;
     }
 
+    pthread_mutex_lock(&file_desc_lock);
+    if ((uint32_t) fileID >= file_desc_table_size || file_desc_table[fileID].inode_num >= NUM_OF_INODES) {
+        pthread_mutex_unlock(&file_desc_lock);
+        return -1;
+    }
     file_desc_table[fileID].read_write_ptr = location;
+    pthread_mutex_unlock(&file_desc_lock);
     return 0;
 }
 
 /**
- * Release the data blocks held by the given inode.
- * @param inode The inode for which the data blocks must be released.
+ * Release the pointer blocks below a pointer block that only cover file blocks past the ones kept,
+ * and the pointer block itself if none of the file blocks it covers are kept.
+ * @param block The data block number of the pointer block.
+ * @param depth The number of levels of pointer blocks below this one.
+ * @param keep The number of file blocks under this pointer block that stay in use.
+ * @param count The number of file blocks in use under this pointer block, which must be more than keep.
  */
-void release_data_blocks(const inode_t inode) {
-    const int blocks_used = CEIL(inode.size, BLOCK_SIZE);
-    for (int i = 0; i < NUM_OF_DATA_PTRS && i < blocks_used; ++i) {
-        set_bit(inode.data_ptrs[i]);
-    }
-    if (blocks_used > NUM_OF_DATA_PTRS) {
-        const uint32_t num_of_ptrs = blocks_used - NUM_OF_DATA_PTRS;
+void release_pointer_blocks(uint32_t block, uint32_t depth, uint32_t keep, uint32_t count) {
+    if (depth > 0) {
         uint32_t ptrs[INDIRECT_LIST_SIZE];
-        // Getting the indirect pointers
-        read_blocks(DATA_BLOCKS_OFFSET + inode.indirect, 1, ptrs);
-        for (int i = 0; i < num_of_ptrs; ++i) {
-            set_bit(ptrs[i]);
+        // Number of file blocks under each of the pointers in this block
+        const uint32_t span = depth == 1 ? INDIRECT_LIST_SIZE : NUM_OF_DOUBLE_INDIRECT_PTRS;
+        journal_read_blocks(DATA_BLOCKS_OFFSET + block, 1, ptrs);
+        for (uint32_t i = keep / span; i < CEIL(count, span); ++i) {
+            const uint32_t start = i * span;
+            release_pointer_blocks(ptrs[i], depth - 1, keep > start ? keep - start : 0,
+                                   count - start < span ? count - start : span);
         }
     }
+    if (keep == 0) {
+        set_bit(block);
+        journal_revoke(DATA_BLOCKS_OFFSET + block);
+    }
 }
 
-int sfs_remove(char *file_name) {
+/**
+ * Release the data blocks held by the given inode past the ones kept, with the allocator locked.
+ * Pointer blocks are released once none of the blocks they cover are kept, and the block map is cut to the kept blocks.
+ * @param inode_num The number of the inode for which the data blocks must be released, which must be pinned.
+ * @param keep The number of blocks at the start of the file that stay in use.
+ */
+void release_data_blocks(uint32_t inode_num, uint32_t keep) {
+    const inode_t inode = *pinned_inode(inode_num);
+    const uint32_t blocks_used = CEIL(inode.size, BLOCK_SIZE);
+    uint32_t blocks[BLOCK_BATCH_SIZE];
+    for (uint32_t i = keep; i < blocks_used; i += BLOCK_BATCH_SIZE) {
+        const uint32_t batch = blocks_used - i < BLOCK_BATCH_SIZE ? blocks_used - i : BLOCK_BATCH_SIZE;
+        lookup_data_blocks(inode_num, i, batch, blocks);
+        for (uint32_t j = 0; j < batch; ++j) {
+            set_bit(blocks[j]);
+            // The blocks of the root directory are metadata, so they must not be replayed once they are reused
+            if (inode_num == super_block.root_dir) {
+                journal_revoke(DATA_BLOCKS_OFFSET + blocks[j]);
+            }
+        }
+    }
+    if (blocks_used > NUM_OF_DATA_PTRS && keep <= NUM_OF_DATA_PTRS) {
+        set_bit(inode.indirect);
+        journal_revoke(DATA_BLOCKS_OFFSET + inode.indirect);
+    }
+    if (blocks_used > DOUBLE_INDIRECT_START && keep < TRIPLE_INDIRECT_START) {
+        const uint32_t count = blocks_used - DOUBLE_INDIRECT_START;
+        const uint32_t kept = keep > DOUBLE_INDIRECT_START ? keep - DOUBLE_INDIRECT_START : 0;
+        release_pointer_blocks(inode.double_indirect, 1, kept,
+                               count < NUM_OF_DOUBLE_INDIRECT_PTRS ? count : NUM_OF_DOUBLE_INDIRECT_PTRS);
+    }
+    if (blocks_used > TRIPLE_INDIRECT_START) {
+        const uint32_t kept = keep > TRIPLE_INDIRECT_START ? keep - TRIPLE_INDIRECT_START : 0;
+        release_pointer_blocks(inode.triple_indirect, 2, kept, blocks_used - TRIPLE_INDIRECT_START);
+    }
+    block_map_t *const map = block_map_of(inode_num);
+    if (map->count > keep) {
+        map->count = keep;
+    }
+}
+
+/**
+ * Release the data blocks of a file and clear its inode, with the file locked for writing.
+ * The inode number is still taken, and is given back by the caller.
+ * @param inode_num The number of the inode of the file, which must be pinned.
+ */
+void release_file(uint32_t inode_num) {
+    pthread_mutex_lock(&alloc_lock);
+    release_data_blocks(inode_num, 0);
+    release_block_map(inode_num);
+    flush_free_bitmap();
+    pthread_mutex_unlock(&alloc_lock);
+
+    pthread_mutex_lock(&inode_table_lock);
+    __atomic_store_n(&pinned_inode(inode_num)->size, 0, __ATOMIC_RELEASE);
+    mark_inode_dirty(inode_num);
+    flush_inode_table();
+    pthread_mutex_unlock(&inode_table_lock);
+}
+
+/**
+ * Remove a file from the directory, releasing its data blocks and its inode.
+ * A file that is open keeps both until its last file descriptor is closed, as with unlink on POSIX.
+ * @param file_name The name of the file.
+ * @return 0 if successful, -1 otherwise.
+ */
+int remove_file(const char *const file_name) {
     uint32_t idx;
+    pthread_rwlock_wrlock(&dir_lock);
     const uint32_t inode_num = find_inode_num(file_name, &idx);
     if (inode_num >= MAX_NUM_OF_DIR_ENTRIES) {
+        pthread_rwlock_unlock(&dir_lock);
+        return -1;
+    }
+    // The inode is read while its data blocks are released
+    if (pin_inode(inode_num) == NULL) {
+        pthread_rwlock_unlock(&dir_lock);
         return -1;
     }
     // Remove the entry from the root directory
-    root_dir[idx].inode_num = 0;
-    move_invalid_entries_to_back(idx);
-    inode_table[super_block.root_dir].size -= sizeof(directory_entry_t);
-    write_from_ptr(inode_table[super_block.root_dir], root_dir);
+    const uint32_t last_idx = num_of_dir_entries() - 1;
+    dir_index_remove(file_name);
+    if (last_idx != idx) {
+        // The last entry is moved into the freed index, so only the block holding that index is written
+        directory_entry_t last;
+        read_dir_entry(last_idx, &last);
+        dir_index_move(last.file_name, last_idx, idx);
+        write_dir_entry(idx, &last);
+    }
+    // The old last entry is past the end of the root directory, so its block does not have to be written
+    // If it was the only entry in its block, the block is released, as growing the directory again allocates a new one
+    const uint32_t root_size = dir_entry_position(last_idx);
+    if (CEIL(root_size, BLOCK_SIZE) < CEIL(pinned_inode(super_block.root_dir)->size, BLOCK_SIZE)) {
+        pthread_mutex_lock(&alloc_lock);
+        release_data_blocks(super_block.root_dir, CEIL(root_size, BLOCK_SIZE));
+        // The removed file may stay open, so its release cannot be relied on to write the bitmap
+        flush_free_bitmap();
+        pthread_mutex_unlock(&alloc_lock);
+    }
+    pthread_mutex_lock(&inode_table_lock);
+    __atomic_store_n(&pinned_inode(super_block.root_dir)->size, root_size, __ATOMIC_RELEASE);
+    mark_inode_dirty(super_block.root_dir);
+    pthread_mutex_unlock(&inode_table_lock);
+
+    pthread_rwlock_wrlock(inode_lock(inode_num));
+    const bool is_released = !is_open(inode_num);
+    if (is_released) {
+        release_file(inode_num);
+    } else {
+        // The open file descriptors keep using the file, the last one to close releases it
+        *unlinked_of(inode_num) = true;
+    }
+    // Only the root directory inode and the free inode map are still to be written
+    pthread_mutex_lock(&inode_table_lock);
+    flush_inode_table();
+    pthread_mutex_unlock(&inode_table_lock);
+    unpin_inode(inode_num);
+    pthread_rwlock_unlock(inode_lock(inode_num));
+    if (is_released) {
+        release_inode_num(inode_num);
+    }
+    pthread_rwlock_unlock(&dir_lock);
 
-    // Release the data blocks
-    release_data_blocks(inode_table[inode_num]);
-    write_blocks(FREE_BITMAP_OFFSET, NUM_OF_FREE_BITMAP_BLOCKS, free_block_map);
+    return 0;
+}
 
-    // Release the inode
-    inode_table[inode_num].size = 0;
-    write_blocks(INODE_BLOCKS_OFFSET, NUM_OF_INODE_BLOCKS, inode_table);
+/**
+ * Change the size of a file in place, with the file locked for writing.
+ * Shrinking releases only the blocks past the new end, growing allocates the blocks it needs and fills them with zeros.
+ * @param inode_num The number of the inode of the file, which must be pinned.
+ * @param size The new size of the file.
+ * @return True if successful, false if the file cannot grow to the new size.
+ */
+bool truncate_file(uint32_t inode_num, uint32_t size) {
+    if (size > MAX_FILE_SIZE) {
+        return false;
+    }
+    inode_t *const inode = pinned_inode(inode_num);
+    const uint32_t old_size = inode->size;
+    if (size > old_size) {
+        if (!allocate_data_blocks_for_inode(size, inode_num)) {
+            return false;
+        }
+        // The tail of the last old block may also hold data left by an earlier shrink
+        zero_file_data(inode_num, old_size, size);
+        return true;
+    }
+    if (size < old_size) {
+        if (CEIL(size, BLOCK_SIZE) < CEIL(old_size, BLOCK_SIZE)) {
+            pthread_mutex_lock(&alloc_lock);
+            release_data_blocks(inode_num, CEIL(size, BLOCK_SIZE));
+            flush_free_bitmap();
+            pthread_mutex_unlock(&alloc_lock);
+        }
+        pthread_mutex_lock(&inode_table_lock);
+        __atomic_store_n(&inode->size, size, __ATOMIC_RELEASE);
+        mark_inode_dirty(inode_num);
+        flush_inode_table();
+        pthread_mutex_unlock(&inode_table_lock);
+    }
+    return true;
+}
 
-    return 0;
+/**
+ * Change the size of an open file, leaving the read and write pointer of the file descriptor alone.
+ * @param fileID The file descriptor of the file.
+ * @param size The new size of the file.
+ * @return 0 if successful, -1 otherwise.
+ */
+int sfs_ftruncate(int fileID, int size) {
+    file_descriptor_entry_t fde;
+    if (size < 0 || !get_file_desc(fileID, &fde)) {
+        return -1;
+    }
+
+    journal_start();
+    pthread_rwlock_wrlock(inode_lock(fde.inode_num));
+    const bool result = truncate_file(fde.inode_num, size);
+    pthread_rwlock_unlock(inode_lock(fde.inode_num));
+    journal_stop();
+    return result ? 0 : -1;
 }
 
+int sfs_remove(char *file_name) {
+    journal_start();
+    const int result = remove_file(file_name);
+    journal_stop();
+    return result;
+}
@@ -10,11 +10,23 @@
 #define INDIRECT_LIST_SIZE (BLOCK_SIZE / sizeof(uint32_t))
 
 typedef struct super_block_t {
-    uint32_t magic;                 // magic number 0xACBD0005
+    uint32_t magic;                 // magic number 0xACBD0006
     uint32_t block_size;
     uint32_t file_sys_size;         // number of blocks
     uint32_t inode_table_length;    // number of blocks
     uint32_t root_dir;              // i-node number
+    uint32_t journal_start;         // first block of the metadata journal
+    uint32_t journal_length;        // number of blocks
+    uint32_t num_of_inodes;
+    uint32_t num_of_data_blocks;
+    uint32_t inode_table_start;     // first block of the inode table
+    uint32_t data_blocks_start;     // first block of the data blocks
+    uint32_t free_bitmap_start;     // first block of the free bitmap
+    uint32_t free_bitmap_length;    // number of blocks
+    uint32_t inode_bitmap_start;    // first block of the inode bitmap
+    uint32_t inode_bitmap_length;   // number of blocks
+    uint32_t dir_index_start;       // first block of the hashed index of the root directory
+    uint32_t dir_index_length;      // number of blocks
 } super_block_t;
 
 typedef struct inode_t {
@@ -25,6 +37,9 @@ typedef struct inode_t {
     uint32_t size;  // This can be used to see how many bytes are occupied (and if it's free)
     uint32_t data_ptrs[NUM_OF_DATA_PTRS];
     uint32_t indirect; // This is a pointer to a data block, which holds pointers to other data blocks, containing the actual data
+    uint32_t double_indirect; // This points to a block of pointers to indirect blocks
+    uint32_t triple_indirect; // This points to a block of pointers to double indirect blocks
+    uint32_t unused[12]; // Pads the inode to 128 bytes, so that no inode straddles two blocks
 } inode_t;
 
 // Use an array of these as our file descriptor table
@@ -38,10 +53,21 @@ typedef struct directory_entry_t {
     uint32_t inode_num;
 } directory_entry_t;
 
+// A file of the root directory as listed by sfs_readdirplus
+typedef struct directory_record_t {
+    char file_name[MAX_FILE_NAME_SIZE + 1];
+    uint32_t inode_num;
+    uint32_t size;
+} directory_record_t;
+
 void mksfs(int);
 
+int mksfs_geometry(int, const char *, uint32_t, uint32_t);
+
 int sfs_getnextfilename(char *);
 
+int sfs_readdirplus(uint32_t *, directory_record_t *, int);
+
 int sfs_getfilesize(const char *);
 
 int sfs_fopen(char *);
@@ -52,8 +78,16 @@ int sfs_fwrite(int, char *, int);
 
 int sfs_fread(int, char *, int);
 
+int sfs_pwrite(int, const char *, int, int);
+
+int sfs_pread(int, char *, int, int);
+
 int sfs_fseek(int, int);
 
+int sfs_ftruncate(int, int);
+
 int sfs_remove(char *);
 
+int sfs_unmount();
+
 #endif
@@ -0,0 +1,525 @@
+/* sfs_test4.c
+ *
+ * Checks the behaviour added on top of the assignment API, each part on the
+ * same small disk, which is left empty between the parts.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "sfs_api.h"
+
+#ifndef TEST_DISK
+#define TEST_DISK "sfs_test4.disk"
+#endif
+#define NUM_OF_DATA_BLOCKS 600
+#define NUM_OF_INODES 40
+#define NAMED_FILES 30
+#define LISTED_FILES 30
+
+/* Fills a buffer with a pattern that depends on the position, so misplaced bytes are caught */
+static void fill_pattern(char *buf, int length, int seed) {
+    int i;
+
+    for (i = 0; i < length; i++) {
+        buf[i] = (char) ('a' + (i + seed) % 26);
+    }
+}
+
+/* Counts the bytes of a buffer that differ from the pattern, or from zero where the pattern is cut off */
+static int count_mismatches(const char *buf, int length, int seed, int pattern_length) {
+    int i;
+    int mismatches = 0;
+
+    for (i = 0; i < length; i++) {
+        const char expected = i < pattern_length ? (char) ('a' + (i + seed) % 26) : 0;
+        if (buf[i] != expected) {
+            mismatches++;
+        }
+    }
+    return mismatches;
+}
+
+/* Names are looked up through the index, and removing a file moves the last entry into its place */
+static int test_names(void) {
+    int error_count = 0;
+    char name[40];
+    char long_name[41];
+    int i;
+    int fd;
+
+    for (i = 0; i < NAMED_FILES; i++) {
+        sprintf(name, "name%d", i);
+        fd = sfs_fopen(name);
+        sfs_fwrite(fd, name, (int) strlen(name));
+        sfs_fclose(fd);
+    }
+    /* Every other file is removed, so most of the others are moved */
+    for (i = 0; i < NAMED_FILES; i += 2) {
+        sprintf(name, "name%d", i);
+        if (sfs_remove(name) != 0) {
+            fprintf(stderr, "ERROR: could not remove %s\n", name);
+            error_count++;
+        }
+    }
+    for (i = 0; i < NAMED_FILES; i++) {
+        sprintf(name, "name%d", i);
+        const int expected = i % 2 == 0 ? -1 : (int) strlen(name);
+        if (sfs_getfilesize(name) != expected) {
+            fprintf(stderr, "ERROR: %s has size %d instead of %d\n", name, sfs_getfilesize(name), expected);
+            error_count++;
+        }
+    }
+    if (sfs_getfilesize("name") != -1 || sfs_getfilesize("name1 ") != -1 || sfs_remove("name0") != -1) {
+        fprintf(stderr, "ERROR: a name that does not exist was found\n");
+        error_count++;
+    }
+
+    /* Names are only stored up to their maximum length, so longer ones must not match a stored prefix */
+    memset(long_name, 'q', 40);
+    long_name[40] = '\0';
+    memcpy(name, long_name, MAX_FILE_NAME_SIZE);
+    name[MAX_FILE_NAME_SIZE] = '\0';
+    fd = sfs_fopen(name);
+    if (fd < 0) {
+        fprintf(stderr, "ERROR: could not create a file with a name of the maximum length\n");
+        error_count++;
+    }
+    sfs_fclose(fd);
+    if (sfs_getfilesize(long_name) != -1 || sfs_fopen(long_name) != -1 || sfs_remove(long_name) != -1) {
+        fprintf(stderr, "ERROR: a name longer than the maximum matched a stored file\n");
+        error_count++;
+    }
+    sfs_remove(name);
+
+    for (i = 1; i < NAMED_FILES; i += 2) {
+        sprintf(name, "name%d", i);
+        sfs_remove(name);
+    }
+    return error_count;
+}
+
+/* The largest file the disk still has room for, found by growing a scratch file until it fails */
+static int free_space(void) {
+    int fd = sfs_fopen("scratch");
+    int size = 0;
+
+    while (sfs_ftruncate(fd, size + 16 * 1024) == 0) {
+        size += 16 * 1024;
+    }
+    sfs_fclose(fd);
+    sfs_remove("scratch");
+    return size;
+}
+
+/* The geometry given at format time is enforced, and read back from the disk when it is mounted */
+static int test_geometry(void) {
+    int error_count = 0;
+    char name[16];
+    int i;
+    int created = 0;
+
+    if (mksfs_geometry(1, TEST_DISK, 0, NUM_OF_INODES) != -1) {
+        fprintf(stderr, "ERROR: formatted a disk without data blocks\n");
+        error_count++;
+    }
+    if (mksfs_geometry(1, TEST_DISK, NUM_OF_DATA_BLOCKS, 1) != -1) {
+        fprintf(stderr, "ERROR: formatted a disk without room for a file\n");
+        error_count++;
+    }
+    if (mksfs_geometry(0, "sfs_test4_missing.disk", 0, 0) != -1) {
+        fprintf(stderr, "ERROR: mounted a disk that does not exist\n");
+        error_count++;
+    }
+    if (mksfs_geometry(1, TEST_DISK, NUM_OF_DATA_BLOCKS, NUM_OF_INODES) != 0) {
+        fprintf(stderr, "ERROR: could not format the test disk\n");
+        return error_count + 1;
+    }
+
+    /* One inode is the root directory, and the highest inode number marks a file that does not exist */
+    for (i = 0; i < NUM_OF_INODES + 5; i++) {
+        sprintf(name, "g%d", i);
+        const int fd = sfs_fopen(name);
+        if (fd < 0) {
+            break;
+        }
+        created++;
+        sfs_fclose(fd);
+    }
+    if (created != NUM_OF_INODES - 2) {
+        fprintf(stderr, "ERROR: created %d files on a disk with %d inodes\n", created, NUM_OF_INODES);
+        error_count++;
+    }
+
+    /* The geometry is read back from the disk */
+    if (mksfs_geometry(0, TEST_DISK, 0, 0) != 0) {
+        fprintf(stderr, "ERROR: could not mount the test disk\n");
+        return error_count + 1;
+    }
+    for (i = 0; i < created; i++) {
+        sprintf(name, "g%d", i);
+        if (sfs_getfilesize(name) != 0) {
+            fprintf(stderr, "ERROR: %s is missing after the remount\n", name);
+            error_count++;
+        }
+        sfs_remove(name);
+    }
+    return error_count;
+}
+
+/* Moves the super block of the unmounted disk into or out of the buffer */
+static int transfer_super_block(super_block_t *super_block, int is_write) {
+    FILE *disk = fopen(TEST_DISK, "r+b");
+    size_t n;
+
+    if (disk == NULL) {
+        return -1;
+    }
+    if (is_write) {
+        n = fwrite(super_block, sizeof(super_block_t), 1, disk);
+    } else {
+        n = fread(super_block, sizeof(super_block_t), 1, disk);
+    }
+    fclose(disk);
+    return n == 1 ? 0 : -1;
+}
+
+/* A disk of the format before the journal, or with a super block that does not match its geometry, is not mounted */
+static int test_super_block(void) {
+    int error_count = 0;
+    super_block_t original;
+    super_block_t changed[4];
+    int i;
+
+    sfs_unmount();
+    if (transfer_super_block(&original, 0) != 0) {
+        fprintf(stderr, "ERROR: could not read the super block\n");
+        return 1;
+    }
+    for (i = 0; i < 4; i++) {
+        changed[i] = original;
+    }
+    changed[0].magic = 0xACBD0005;
+    changed[1].num_of_inodes++;
+    changed[2].free_bitmap_start++;
+    changed[3].journal_length--;
+
+    for (i = 0; i < 4; i++) {
+        transfer_super_block(&changed[i], 1);
+        if (mksfs_geometry(0, TEST_DISK, 0, 0) != -1) {
+            fprintf(stderr, "ERROR: mounted a disk with super block change %d\n", i);
+            error_count++;
+            sfs_unmount();
+        }
+    }
+    transfer_super_block(&original, 1);
+    if (mksfs_geometry(0, TEST_DISK, 0, 0) != 0) {
+        fprintf(stderr, "ERROR: could not mount the disk once its super block was restored\n");
+        error_count++;
+    }
+    return error_count;
+}
+
+/* Only the changed directory blocks are written, so what a remount reads must still match after entries move */
+static int test_directory_blocks(void) {
+    int error_count = 0;
+    char name[16];
+    int cycle;
+    int i;
+    int fd;
+    const int space = free_space();
+
+    /* Every file the disk holds, so the root directory grows into a second block and shrinks back */
+    for (cycle = 0; cycle < 2; cycle++) {
+        for (i = 0; i < NUM_OF_INODES - 2; i++) {
+            sprintf(name, "dir%d", i);
+            fd = sfs_fopen(name);
+            sfs_fwrite(fd, name, (int) strlen(name));
+            sfs_fclose(fd);
+        }
+        for (i = cycle; i < NUM_OF_INODES - 2; i += 2) {
+            sprintf(name, "dir%d", i);
+            sfs_remove(name);
+        }
+        sfs_unmount();
+        if (mksfs_geometry(0, TEST_DISK, 0, 0) != 0) {
+            fprintf(stderr, "ERROR: could not mount the disk in cycle %d\n", cycle);
+            return error_count + 1;
+        }
+        for (i = 0; i < NUM_OF_INODES - 2; i++) {
+            sprintf(name, "dir%d", i);
+            const int expected = i % 2 == cycle ? -1 : (int) strlen(name);
+            if (sfs_getfilesize(name) != expected) {
+                fprintf(stderr, "ERROR: %s has size %d after the remount instead of %d\n", name,
+                        sfs_getfilesize(name), expected);
+                error_count++;
+            }
+            sfs_remove(name);
+        }
+    }
+    const int end_space = free_space();
+    if (end_space != space) {
+        fprintf(stderr, "ERROR: %d bytes free after growing and shrinking the directory instead of %d\n", end_space,
+                space);
+        error_count++;
+    }
+    return error_count;
+}
+
+/* Positional calls leave the read and write pointer alone and stop at the end of the file */
+static int test_positional(void) {
+    int error_count = 0;
+    char data[5000];
+    char buf[6000];
+    const int fd = sfs_fopen("positional");
+
+    fill_pattern(data, sizeof(data), 3);
+    if (sfs_pwrite(fd, data, sizeof(data), 0) != sizeof(data)) {
+        fprintf(stderr, "ERROR: sfs_pwrite wrote the wrong number of bytes\n");
+        error_count++;
+    }
+    /* The read and write pointer stays at the start of the file */
+    if (sfs_fread(fd, buf, 10) != 10 || count_mismatches(buf, 10, 3, 10) != 0) {
+        fprintf(stderr, "ERROR: sfs_pwrite moved the read and write pointer\n");
+        error_count++;
+    }
+    if (sfs_pread(fd, buf, 100, 2000) != 100 || count_mismatches(buf, 100, 2003, 100) != 0) {
+        fprintf(stderr, "ERROR: sfs_pread read the wrong bytes\n");
+        error_count++;
+    }
+    if (sfs_pread(fd, buf, sizeof(buf), 4000) != 1000) {
+        fprintf(stderr, "ERROR: sfs_pread read past the end of the file\n");
+        error_count++;
+    }
+    if (sfs_pread(fd, buf, 10, 6000) != 0) {
+        fprintf(stderr, "ERROR: sfs_pread read from past the end of the file\n");
+        error_count++;
+    }
+    if (sfs_pwrite(fd, data, 10, -1) != 0 || sfs_pread(fd, buf, 10, -1) != 0) {
+        fprintf(stderr, "ERROR: a negative offset was accepted\n");
+        error_count++;
+    }
+    sfs_fclose(fd);
+    sfs_remove("positional");
+    return error_count;
+}
+
+/* Writing past the end leaves a hole that reads as zeros, even over blocks that held another file */
+static int test_holes(void) {
+    int error_count = 0;
+    char data[32 * 1024];
+    char buf[20001];
+    int fd;
+
+    /* The blocks of a removed file are handed out again, with its data still in them */
+    memset(data, 'A', sizeof(data));
+    fd = sfs_fopen("old");
+    sfs_fwrite(fd, data, sizeof(data));
+    sfs_fclose(fd);
+    sfs_remove("old");
+
+    fd = sfs_fopen("holes");
+    if (sfs_pwrite(fd, "B", 1, 20000) != 1) {
+        fprintf(stderr, "ERROR: could not write past the end of the file\n");
+        error_count++;
+    }
+    if (sfs_getfilesize("holes") != 20001) {
+        fprintf(stderr, "ERROR: writing past the end made the file %d bytes\n", sfs_getfilesize("holes"));
+        error_count++;
+    }
+    if (sfs_pread(fd, buf, sizeof(buf), 0) != sizeof(buf)
+        || count_mismatches(buf, 20000, 0, 0) != 0 || buf[20000] != 'B') {
+        fprintf(stderr, "ERROR: the hole does not read as zeros\n");
+        error_count++;
+    }
+    sfs_fclose(fd);
+    sfs_remove("holes");
+    return error_count;
+}
+
+/* Truncation releases or adds only the blocks past the smaller of the two sizes */
+static int test_truncate(void) {
+    int error_count = 0;
+    const int large = 400 * 1024;
+    char *data = malloc(large);
+    char *buf = malloc(large);
+    const int space = free_space();
+    int fd;
+    int n;
+
+    fill_pattern(data, large, 7);
+    fd = sfs_fopen("truncated");
+    sfs_fwrite(fd, data, large);
+
+    /* Shrinking keeps the start of the file, past the indirect block */
+    if (sfs_ftruncate(fd, 300 * 1024 + 5) != 0 || sfs_getfilesize("truncated") != 300 * 1024 + 5) {
+        fprintf(stderr, "ERROR: could not shrink the file\n");
+        error_count++;
+    }
+    if (sfs_pread(fd, buf, large, 0) != 300 * 1024 + 5 || count_mismatches(buf, 300 * 1024 + 5, 7, large) != 0) {
+        fprintf(stderr, "ERROR: shrinking changed the bytes that were kept\n");
+        error_count++;
+    }
+
+    /* Growing again must not bring back the bytes that were cut off */
+    if (sfs_ftruncate(fd, 2000) != 0 || sfs_ftruncate(fd, 9000) != 0) {
+        fprintf(stderr, "ERROR: could not shrink and grow the file\n");
+        error_count++;
+    }
+    if (sfs_pread(fd, buf, large, 0) != 9000 || count_mismatches(buf, 9000, 7, 2000) != 0) {
+        fprintf(stderr, "ERROR: the grown part of the file does not read as zeros\n");
+        error_count++;
+    }
+
+    /* Truncating leaves the read and write pointer alone */
+    sfs_fseek(fd, 100);
+    sfs_ftruncate(fd, 50);
+    if (sfs_fwrite(fd, "x", 1) != 1 || sfs_getfilesize("truncated") != 101) {
+        fprintf(stderr, "ERROR: truncating moved the read and write pointer\n");
+        error_count++;
+    }
+
+    if (sfs_ftruncate(fd, -1) != -1 || sfs_ftruncate(fd + 100, 0) != -1) {
+        fprintf(stderr, "ERROR: a negative size or a bad file descriptor was accepted\n");
+        error_count++;
+    }
+    if (sfs_ftruncate(fd, (NUM_OF_DATA_BLOCKS + 1) * BLOCK_SIZE) != -1 || sfs_getfilesize("truncated") != 101) {
+        fprintf(stderr, "ERROR: growing past the size of the disk changed the file\n");
+        error_count++;
+    }
+
+    /* Every block released by the truncation can be used again */
+    sfs_ftruncate(fd, 0);
+    sfs_fclose(fd);
+    n = free_space();
+    if (n != space) {
+        fprintf(stderr, "ERROR: truncation leaked blocks, %d bytes free instead of %d\n", n, space);
+        error_count++;
+    }
+    sfs_remove("truncated");
+    free(data);
+    free(buf);
+    return error_count;
+}
+
+/* A listing is a cursor held by its caller, and each record carries the size of the file */
+static int test_readdirplus(void) {
+    int error_count = 0;
+    directory_record_t records[7];
+    directory_record_t record;
+    char data[LISTED_FILES];
+    int seen[LISTED_FILES] = {0};
+    uint32_t cursor = 0;
+    uint32_t other_cursor = 0;
+    char name[16];
+    int listed = 0;
+    int n;
+    int i;
+
+    memset(data, 'l', sizeof(data));
+    for (i = 0; i < LISTED_FILES; i++) {
+        sprintf(name, "list%d", i);
+        const int fd = sfs_fopen(name);
+        sfs_fwrite(fd, data, i);
+        sfs_fclose(fd);
+    }
+
+    /* Two listings run side by side without disturbing each other */
+    while ((n = sfs_readdirplus(&cursor, records, 7)) > 0) {
+        for (i = 0; i < n; i++) {
+            int k;
+            if (sscanf(records[i].file_name, "list%d", &k) != 1 || k < 0 || k >= LISTED_FILES) {
+                fprintf(stderr, "ERROR: listed an unknown file %s\n", records[i].file_name);
+                error_count++;
+                continue;
+            }
+            seen[k]++;
+            if (records[i].size != (uint32_t) k) {
+                fprintf(stderr, "ERROR: listed %s with size %u\n", records[i].file_name, records[i].size);
+                error_count++;
+            }
+        }
+        listed += n;
+        if (sfs_readdirplus(&other_cursor, &record, 1) != 1) {
+            fprintf(stderr, "ERROR: the second listing ended early\n");
+            error_count++;
+        }
+    }
+    if (n < 0 || listed != LISTED_FILES || sfs_readdirplus(&cursor, records, 7) != 0) {
+        fprintf(stderr, "ERROR: listed %d files instead of %d\n", listed, LISTED_FILES);
+        error_count++;
+    }
+    for (i = 0; i < LISTED_FILES; i++) {
+        if (seen[i] != 1) {
+            fprintf(stderr, "ERROR: list%d was listed %d times\n", i, seen[i]);
+            error_count++;
+        }
+        sprintf(name, "list%d", i);
+        sfs_remove(name);
+    }
+    return error_count;
+}
+
+/* A removed file stays usable through the descriptors open on it, apart from the new file of the same name */
+static int test_remove_open(void) {
+    int error_count = 0;
+    char buf[64];
+    const int fd = sfs_fopen("removed");
+    int other;
+
+    sfs_fwrite(fd, "hello", 5);
+    if (sfs_remove("removed") != 0 || sfs_getfilesize("removed") != -1) {
+        fprintf(stderr, "ERROR: could not remove an open file\n");
+        error_count++;
+    }
+
+    other = sfs_fopen("removed");
+    if (other < 0 || sfs_getfilesize("removed") != 0) {
+        fprintf(stderr, "ERROR: could not create a file with the name of a removed open file\n");
+        error_count++;
+    }
+    sfs_fseek(fd, 5);
+    if (sfs_fwrite(fd, "0123456789", 10) != 10 || sfs_fseek(fd, 0) != 0 || sfs_fread(fd, buf, sizeof(buf)) != 15
+        || memcmp(buf, "hello0123456789", 15) != 0) {
+        fprintf(stderr, "ERROR: the removed file cannot be used through its open file descriptor\n");
+        error_count++;
+    }
+    if (sfs_getfilesize("removed") != 0) {
+        fprintf(stderr, "ERROR: writes to the removed file went into the new file\n");
+        error_count++;
+    }
+    if (sfs_fclose(fd) != 0 || sfs_fclose(fd) != -1) {
+        fprintf(stderr, "ERROR: could not close the removed file exactly once\n");
+        error_count++;
+    }
+    sfs_fclose(other);
+    sfs_remove("removed");
+    return error_count;
+}
+
+int main() {
+    int error_count = test_geometry();
+
+    error_count += test_super_block();
+    /* The parts below leave the disk empty, so the space they start with must be free at the end */
+    const int space = free_space();
+    error_count += test_names();
+    error_count += test_directory_blocks();
+    error_count += test_positional();
+    error_count += test_holes();
+    error_count += test_truncate();
+    error_count += test_readdirplus();
+    error_count += test_remove_open();
+
+    /* Every file was removed, so all of their blocks are free again */
+    const int end_space = free_space();
+    if (end_space != space) {
+        fprintf(stderr, "ERROR: %d bytes free at the end instead of %d\n", end_space, space);
+        error_count++;
+    }
+    sfs_unmount();
+    remove(TEST_DISK);
+
+    fprintf(stderr, "Test program exiting with %d errors\n", error_count);
+    return (error_count);
+}
@@ -0,0 +1,256 @@
+/* sfs_test5.c
+ *
+ * Checks that the file system comes back intact after an unclean exit.
+ * A child process changes the disk and exits without unmounting, then the
+ * parent mounts the disk again and checks what the child committed. The
+ * metadata of the last changes is then only in the journal.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "sfs_api.h"
+
+#define TEST_DISK "sfs_test5.disk"
+#define NUM_OF_DATA_BLOCKS 2000
+#define NUM_OF_INODES 64
+#define DIR_ENTRIES_PER_BLOCK (BLOCK_SIZE / sizeof(directory_entry_t))
+#define NUM_OF_FILES 20
+#define NUM_OF_CRASHES 3
+
+/* The largest file the disk still has room for, found by growing a scratch file until it fails */
+static int free_space(void) {
+    int fd = sfs_fopen("scratch");
+    int size = 0;
+
+    while (sfs_ftruncate(fd, size + BLOCK_SIZE) == 0) {
+        size += BLOCK_SIZE;
+    }
+    sfs_fclose(fd);
+    sfs_remove("scratch");
+    return size;
+}
+
+/* Runs the changes of a round in a child process that exits without unmounting, then mounts the disk again */
+static int crash(void (*changes)(int), int round) {
+    int status;
+    const pid_t pid = fork();
+
+    if (pid < 0) {
+        fprintf(stderr, "ERROR: could not start the crashing process\n");
+        return 1;
+    }
+    if (pid == 0) {
+        if (mksfs_geometry(0, TEST_DISK, 0, 0) != 0) {
+            _exit(100);
+        }
+        changes(round);
+        _exit(0);
+    }
+    waitpid(pid, &status, 0);
+    if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+        fprintf(stderr, "ERROR: the crashing process failed in round %d\n", round);
+        return 1;
+    }
+    if (mksfs_geometry(0, TEST_DISK, 0, 0) != 0) {
+        fprintf(stderr, "ERROR: could not mount the disk after round %d\n", round);
+        return 1;
+    }
+    return 0;
+}
+
+/* Removes an open file as the last entry of a root directory block, then commits something else */
+static void remove_open_file(int round) {
+    char name[16];
+    uint32_t i;
+
+    for (i = 0; i <= DIR_ENTRIES_PER_BLOCK; i++) {
+        sprintf(name, "entry%u", i);
+        sfs_fclose(sfs_fopen(name));
+    }
+    /* The file stays open, so the root directory block is the only thing its removal frees */
+    sfs_fopen(name);
+    sfs_remove(name);
+    sfs_fclose(sfs_fopen("entry0"));
+}
+
+/* The block freed by shrinking the root directory must be free after the crash */
+static int test_remove_open_file(void) {
+    int error_count = 0;
+    char name[16];
+    uint32_t i;
+    const int space = free_space();
+
+    sfs_unmount();
+    if (crash(remove_open_file, 0) != 0) {
+        return 1;
+    }
+    for (i = 0; i < DIR_ENTRIES_PER_BLOCK; i++) {
+        sprintf(name, "entry%u", i);
+        if (sfs_remove(name) != 0) {
+            fprintf(stderr, "ERROR: %s is missing after the crash\n", name);
+            error_count++;
+        }
+    }
+    sprintf(name, "entry%u", i);
+    if (sfs_getfilesize(name) != -1) {
+        fprintf(stderr, "ERROR: the removed file came back after the crash\n");
+        error_count++;
+    }
+    const int end_space = free_space();
+    if (end_space != space) {
+        fprintf(stderr, "ERROR: %d bytes free after the crash instead of %d\n", end_space, space);
+        error_count++;
+    }
+    return error_count;
+}
+
+/* The contents of a file are a pattern set by its number and the round that last wrote it */
+static void fill_pattern(char *buf, int length, int file, int round) {
+    int i;
+
+    for (i = 0; i < length; i++) {
+        buf[i] = (char) ('A' + (i * 7 + file * 3 + round) % 26);
+    }
+}
+
+/* The size a file has after the given round */
+static int file_size(int file, int round) {
+    return ((file + 1) * 3001 + round * 997) % (40 * 1024);
+}
+
+/* Whether a file exists after the given round, every round removes some files and brings others back */
+static int file_exists(int file, int round) {
+    return (file + round) % 4 != 0;
+}
+
+/* Changes the files to what they are after the given round */
+static void change_files(int round) {
+    char *buf = malloc(64 * 1024);
+    char name[16];
+    int file;
+
+    /* A removal is only committed with a later close, so the files are removed first */
+    for (file = 0; file < NUM_OF_FILES; file++) {
+        sprintf(name, "crash%d", file);
+        if (!file_exists(file, round)) {
+            sfs_remove(name);
+        }
+    }
+    for (file = 0; file < NUM_OF_FILES; file++) {
+        if (!file_exists(file, round)) {
+            continue;
+        }
+        sprintf(name, "crash%d", file);
+        const int fd = sfs_fopen(name);
+        const int size = file_size(file, round);
+        /* Writing more than is kept leaves blocks for the truncation to release */
+        fill_pattern(buf, size + 5000, file, round);
+        sfs_pwrite(fd, buf, size + 5000, 0);
+        sfs_ftruncate(fd, size);
+        sfs_fclose(fd);
+    }
+
+    /* A change that is never committed may or may not survive, but must not damage the rest */
+    const int fd = sfs_fopen("uncommitted");
+    sfs_fwrite(fd, buf, 20 * 1024);
+}
+
+/* Checks the files of the mounted disk against the given round */
+static int check_round(int round) {
+    int error_count = 0;
+    char *expected = malloc(64 * 1024);
+    char *buf = malloc(64 * 1024);
+    char name[16];
+    int file;
+
+    for (file = 0; file < NUM_OF_FILES; file++) {
+        sprintf(name, "crash%d", file);
+        if (!file_exists(file, round)) {
+            if (sfs_getfilesize(name) != -1) {
+                fprintf(stderr, "ERROR: %s came back after being removed in round %d\n", name, round);
+                error_count++;
+            }
+            continue;
+        }
+        const int size = file_size(file, round);
+        if (sfs_getfilesize(name) != size) {
+            fprintf(stderr, "ERROR: %s is %d bytes after round %d instead of %d\n", name, sfs_getfilesize(name), round,
+                    size);
+            error_count++;
+            continue;
+        }
+        const int fd = sfs_fopen(name);
+        fill_pattern(expected, size, file, round);
+        if (sfs_pread(fd, buf, 64 * 1024, 0) != size || memcmp(buf, expected, size) != 0) {
+            fprintf(stderr, "ERROR: %s has the wrong contents after round %d\n", name, round);
+            error_count++;
+        }
+        sfs_fclose(fd);
+    }
+    free(expected);
+    free(buf);
+    return error_count;
+}
+
+/* Fills the disk and checks that the files are still intact, so that no block is both free and in use */
+static int check_free_blocks(int round) {
+    int error_count = 0;
+    char *buf = calloc(16 * 1024, 1);
+    int fd = sfs_fopen("filler");
+
+    while (sfs_fwrite(fd, buf, 16 * 1024) == 16 * 1024) {
+    }
+    sfs_fclose(fd);
+    error_count += check_round(round);
+    sfs_remove("filler");
+    if (sfs_getfilesize("filler") != -1) {
+        fprintf(stderr, "ERROR: could not remove the file that filled the disk\n");
+        error_count++;
+    }
+    free(buf);
+    return error_count;
+}
+
+/* Every change committed before a crash is replayed from the journal, and the replay is itself durable */
+static int test_journal_replay(void) {
+    int error_count = 0;
+    int round;
+
+    for (round = 0; round < NUM_OF_CRASHES; round++) {
+        sfs_unmount();
+        if (crash(change_files, round) != 0) {
+            return error_count + 1;
+        }
+        error_count += check_round(round);
+        error_count += check_free_blocks(round);
+        sfs_remove("uncommitted");
+
+        /* A clean unmount after a replay leaves nothing more to replay */
+        sfs_unmount();
+        if (mksfs_geometry(0, TEST_DISK, 0, 0) != 0) {
+            fprintf(stderr, "ERROR: could not mount the disk again after round %d\n", round);
+            return error_count + 1;
+        }
+        error_count += check_round(round);
+    }
+    return error_count;
+}
+
+int main() {
+    int error_count = 0;
+
+    if (mksfs_geometry(1, TEST_DISK, NUM_OF_DATA_BLOCKS, NUM_OF_INODES) != 0) {
+        fprintf(stderr, "ERROR: could not format the test disk\n");
+        return 1;
+    }
+    error_count += test_remove_open_file();
+    error_count += test_journal_replay();
+    sfs_unmount();
+    remove(TEST_DISK);
+
+    fprintf(stderr, "Test program exiting with %d errors\n", error_count);
+    return (error_count);
+}
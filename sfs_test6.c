@@ -0,0 +1,324 @@
+/* sfs_test6.c
+ *
+ * Checks the layers under the file system on a raw disk: the block cache
+ * and its counters, the asynchronous queue, and the memory mapped backend.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "disk_emu.h"
+#include "block_cache.h"
+#include "sfs_api.h"
+
+#define TEST_DISK "sfs_test6.disk"
+#define MAPPED_DISK "sfs_test6_mmap.disk"
+#define NUM_OF_BLOCKS 256
+#define CACHE_BLOCKS 8
+#define QUEUED_BLOCKS 16
+
+/* Fills a block with a pattern set by its number and a round, so blocks from another write are caught */
+static void fill_block(char *buf, int block, int round) {
+    int i;
+
+    for (i = 0; i < BLOCK_SIZE; i++) {
+        buf[i] = (char) (block * 31 + round * 7 + i);
+    }
+}
+
+/* Checks that a block on the disk itself, not in the cache, holds the pattern */
+static int check_disk_block(int block, int round) {
+    char expected[BLOCK_SIZE];
+    char buf[BLOCK_SIZE];
+
+    fill_block(expected, block, round);
+    if (read_blocks(block, 1, buf) != 1 || memcmp(buf, expected, BLOCK_SIZE) != 0) {
+        fprintf(stderr, "ERROR: disk block %d does not hold round %d\n", block, round);
+        return 1;
+    }
+    return 0;
+}
+
+/* Checks the counters against the hits and misses expected since the cache was set up */
+static int check_stats(const char *step, uint64_t hits, uint64_t misses) {
+    uint64_t cache_hits;
+    uint64_t cache_misses;
+
+    block_cache_stats(&cache_hits, &cache_misses);
+    if (cache_hits != hits || cache_misses != misses) {
+        fprintf(stderr, "ERROR: after %s the cache counted %llu hits and %llu misses instead of %llu and %llu\n", step,
+                (unsigned long long) cache_hits, (unsigned long long) cache_misses, (unsigned long long) hits,
+                (unsigned long long) misses);
+        return 1;
+    }
+    return 0;
+}
+
+static int test_block_cache(void) {
+    int error_count = 0;
+    char buf[4 * BLOCK_SIZE];
+    char expected[BLOCK_SIZE];
+    int i;
+
+    if (block_cache_init(CACHE_BLOCKS) != 0) {
+        fprintf(stderr, "ERROR: could not set up the block cache\n");
+        return 1;
+    }
+    error_count += check_stats("setting up the cache", 0, 0);
+
+    /* A single block write is kept in the cache until it is flushed */
+    fill_block(buf, 3, 1);
+    cache_write_blocks(3, 1, buf);
+    error_count += check_stats("writing an uncached block", 0, 1);
+    if (read_blocks(3, 1, buf) != 1 || buf[0] != 0) {
+        fprintf(stderr, "ERROR: a cached write reached the disk before the flush\n");
+        error_count++;
+    }
+    fill_block(expected, 3, 1);
+    if (cache_read_blocks(3, 1, buf) != 1 || memcmp(buf, expected, BLOCK_SIZE) != 0) {
+        fprintf(stderr, "ERROR: the cache did not return the block written to it\n");
+        error_count++;
+    }
+    error_count += check_stats("reading the cached block", 1, 1);
+
+    /* A longer read is served from the cache where it can be and counted per block */
+    cache_read_blocks(5, 1, buf);
+    error_count += check_stats("reading an uncached block", 1, 2);
+    cache_read_blocks(3, 4, buf);
+    error_count += check_stats("reading blocks 3 to 6", 3, 4);
+    if (memcmp(buf, expected, BLOCK_SIZE) != 0) {
+        fprintf(stderr, "ERROR: a longer read missed the cached block\n");
+        error_count++;
+    }
+
+    if (block_cache_flush() != 0) {
+        fprintf(stderr, "ERROR: could not flush the cache\n");
+        error_count++;
+    }
+    error_count += check_disk_block(3, 1);
+
+    /* A longer write goes to the disk and replaces the copies in the cache */
+    for (i = 0; i < 4; i++) {
+        fill_block(buf + i * BLOCK_SIZE, 3 + i, 2);
+    }
+    cache_write_blocks(3, 4, buf);
+    error_count += check_disk_block(3, 2);
+    fill_block(expected, 3, 2);
+    if (cache_read_blocks(3, 1, buf) != 1 || memcmp(buf, expected, BLOCK_SIZE) != 0) {
+        fprintf(stderr, "ERROR: a longer write left a stale block in the cache\n");
+        error_count++;
+    }
+
+    /* Writing more blocks than the cache holds writes the evicted ones back */
+    for (i = 0; i < 4 * CACHE_BLOCKS; i++) {
+        fill_block(buf, 100 + i, 3);
+        cache_write_blocks(100 + i, 1, buf);
+    }
+    block_cache_flush();
+    for (i = 0; i < 4 * CACHE_BLOCKS; i++) {
+        error_count += check_disk_block(100 + i, 3);
+    }
+
+    /* Dropping the cache loses nothing that was flushed, and setting it up again starts the counters over */
+    block_cache_invalidate();
+    if (block_cache_init(CACHE_BLOCKS) != 0) {
+        fprintf(stderr, "ERROR: could not set up the block cache again\n");
+        error_count++;
+    }
+    fill_block(expected, 100, 3);
+    if (cache_read_blocks(100, 1, buf) != 1 || memcmp(buf, expected, BLOCK_SIZE) != 0) {
+        fprintf(stderr, "ERROR: a flushed block was lost\n");
+        error_count++;
+    }
+    error_count += check_stats("reading after setting up the cache again", 0, 1);
+    return error_count;
+}
+
+/* Submits a single block request with the given owner */
+static void submit_block(disk_request *request, int is_write, int block, char *buf, void *user_data) {
+    request->is_write = is_write;
+    request->start_address = block;
+    request->nblocks = 1;
+    request->buffer = buf;
+    request->user_data = user_data;
+    if (submit_blocks(request) != 0) {
+        fprintf(stderr, "ERROR: could not submit a request for block %d\n", block);
+        request->result = -1;
+    }
+}
+
+/* Each request completes exactly once with its own result, whoever reaps it */
+static int test_disk_queue(void) {
+    int error_count = 0;
+    disk_request requests[QUEUED_BLOCKS];
+    disk_request *completed[QUEUED_BLOCKS];
+    char buf[QUEUED_BLOCKS * BLOCK_SIZE];
+    char expected[BLOCK_SIZE];
+    int owners[2];
+    int status;
+    int i;
+    int n;
+
+    /* More writes than the depth, so submitting waits for the workers */
+    if (start_disk_queue(4, 4) != 0) {
+        fprintf(stderr, "ERROR: could not start the queue\n");
+        return 1;
+    }
+    for (i = 0; i < QUEUED_BLOCKS; i++) {
+        fill_block(buf + i * BLOCK_SIZE, 200 + i, 5);
+        submit_block(&requests[i], 1, 200 + i, buf + i * BLOCK_SIZE, NULL);
+    }
+    n = reap_blocks(completed, QUEUED_BLOCKS, QUEUED_BLOCKS);
+    if (n != QUEUED_BLOCKS) {
+        fprintf(stderr, "ERROR: reaped %d of %d writes\n", n, QUEUED_BLOCKS);
+        error_count++;
+    }
+    for (i = 0; i < n; i++) {
+        if (completed[i]->result != 1) {
+            fprintf(stderr, "ERROR: a queued write of block %d returned %d\n", completed[i]->start_address,
+                    completed[i]->result);
+            error_count++;
+        }
+    }
+    for (i = 0; i < QUEUED_BLOCKS; i++) {
+        error_count += check_disk_block(200 + i, 5);
+    }
+
+    /* Two submitters share the queue, each only reaps its own requests */
+    memset(buf, 0, sizeof(buf));
+    for (i = 0; i < QUEUED_BLOCKS; i++) {
+        submit_block(&requests[i], 0, 200 + i, buf + i * BLOCK_SIZE, &owners[i % 2]);
+    }
+    n = reap_blocks_matching(completed, QUEUED_BLOCKS, QUEUED_BLOCKS / 2, &owners[0]);
+    if (n != QUEUED_BLOCKS / 2) {
+        fprintf(stderr, "ERROR: reaped %d reads of the first submitter instead of %d\n", n, QUEUED_BLOCKS / 2);
+        error_count++;
+    }
+    for (i = 0; i < n; i++) {
+        if (completed[i]->user_data != &owners[0]) {
+            fprintf(stderr, "ERROR: reaped a read of another submitter\n");
+            error_count++;
+        }
+    }
+    drain_disk_queue();
+    n = reap_blocks(completed, QUEUED_BLOCKS, 0);
+    if (n != QUEUED_BLOCKS / 2 || completed[0]->user_data != &owners[1]) {
+        fprintf(stderr, "ERROR: the reads of the second submitter were not left for it\n");
+        error_count++;
+    }
+    for (i = 0; i < QUEUED_BLOCKS; i++) {
+        fill_block(expected, 200 + i, 5);
+        if (requests[i].result != 1 || memcmp(buf + i * BLOCK_SIZE, expected, BLOCK_SIZE) != 0) {
+            fprintf(stderr, "ERROR: a queued read of block %d returned the wrong data\n", 200 + i);
+            error_count++;
+        }
+    }
+
+    /* A failing request still completes, and reaping with nothing in flight returns at once */
+    submit_block(&requests[0], 1, NUM_OF_BLOCKS, buf, NULL);
+    if (reap_blocks(completed, QUEUED_BLOCKS, QUEUED_BLOCKS) != 1 || completed[0]->result != -1) {
+        fprintf(stderr, "ERROR: a write past the end of the disk did not fail through the queue\n");
+        error_count++;
+    }
+    if (reap_blocks(completed, QUEUED_BLOCKS, 1) != 0) {
+        fprintf(stderr, "ERROR: reaped a request that was never submitted\n");
+        error_count++;
+    }
+
+    /* Stopping runs what is queued, and the next submission starts the workers again */
+    submit_block(&requests[0], 0, 200, buf, NULL);
+    stop_disk_queue();
+    submit_block(&requests[1], 0, 201, buf + BLOCK_SIZE, NULL);
+    if (reap_blocks(completed, QUEUED_BLOCKS, 2) != 2 || requests[0].result != 1 || requests[1].result != 1) {
+        fprintf(stderr, "ERROR: a request was lost across stopping the queue\n");
+        error_count++;
+    }
+
+    /* The workers are not copied into a child, which gets its own as soon as it submits */
+    const pid_t pid = fork();
+    if (pid == 0) {
+        alarm(10);
+        submit_block(&requests[0], 0, 202, buf, NULL);
+        _exit(reap_blocks(completed, 1, 1) == 1 && requests[0].result == 1 ? 0 : 1);
+    }
+    if (pid < 0 || waitpid(pid, &status, 0) != pid || !WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+        fprintf(stderr, "ERROR: a child process could not use the queue\n");
+        error_count++;
+    }
+    stop_disk_queue();
+    return error_count;
+}
+
+/* The mapped disk is the same file as the one written with file I/O, and a short image is turned away */
+static int test_mmap_backend(void) {
+    int error_count = 0;
+    char buf[3 * BLOCK_SIZE];
+    int i;
+
+    if (init_fresh_disk_flags(MAPPED_DISK, BLOCK_SIZE, NUM_OF_BLOCKS, DISK_MMAP) != 0) {
+        fprintf(stderr, "ERROR: could not create a mapped disk\n");
+        return 1;
+    }
+    if (read_blocks(NUM_OF_BLOCKS - 1, 1, buf) != 1 || buf[BLOCK_SIZE - 1] != 0) {
+        fprintf(stderr, "ERROR: a fresh mapped disk does not read as zeros\n");
+        error_count++;
+    }
+    for (i = 0; i < 3; i++) {
+        fill_block(buf + i * BLOCK_SIZE, 10 + i, 4);
+    }
+    if (write_blocks(10, 3, buf) != 3 || write_blocks(NUM_OF_BLOCKS - 1, 2, buf) != -1) {
+        fprintf(stderr, "ERROR: writes to the mapped disk were not checked against its size\n");
+        error_count++;
+    }
+    for (i = 0; i < 3; i++) {
+        error_count += check_disk_block(10 + i, 4);
+    }
+    if (sync_disk() != 0) {
+        fprintf(stderr, "ERROR: could not sync the mapped disk\n");
+        error_count++;
+    }
+    close_disk();
+
+    /* What was written through the mapping is in the file */
+    if (init_disk(MAPPED_DISK, BLOCK_SIZE, NUM_OF_BLOCKS) != 0) {
+        fprintf(stderr, "ERROR: could not open the mapped disk with file I/O\n");
+        return error_count + 1;
+    }
+    for (i = 0; i < 3; i++) {
+        error_count += check_disk_block(10 + i, 4);
+    }
+    close_disk();
+
+    if (init_disk_flags(MAPPED_DISK, BLOCK_SIZE, NUM_OF_BLOCKS, DISK_MMAP) != 0) {
+        fprintf(stderr, "ERROR: could not map an existing disk\n");
+        error_count++;
+    }
+    error_count += check_disk_block(11, 4);
+    close_disk();
+    if (init_disk_flags(MAPPED_DISK, BLOCK_SIZE, 2 * NUM_OF_BLOCKS, DISK_MMAP) != -1) {
+        fprintf(stderr, "ERROR: mapped an existing disk shorter than asked for\n");
+        error_count++;
+        close_disk();
+    }
+    remove(MAPPED_DISK);
+    return error_count;
+}
+
+int main() {
+    int error_count = 0;
+
+    if (init_fresh_disk(TEST_DISK, BLOCK_SIZE, NUM_OF_BLOCKS) != 0) {
+        fprintf(stderr, "ERROR: could not create the test disk\n");
+        return 1;
+    }
+    error_count += test_block_cache();
+    error_count += test_disk_queue();
+    close_disk();
+    remove(TEST_DISK);
+    error_count += test_mmap_backend();
+
+    fprintf(stderr, "Test program exiting with %d errors\n", error_count);
+    return (error_count);
+}